@@ -0,0 +1,184 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1(the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/.
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis,WITHOUT WARRANTY OF ANY KIND,either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * Alternatively,the contents of this file may be used under the terms
+ * of the GNU General Public License(the "GPL"),in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License,indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above,a recipient may use your
+ * version of this file under either the License or the GPL.
+ *
+ * Author Vlad Seryakov vlad@crystalballinc.com
+ *
+ */
+
+/*
+ * replybench.c -- reply encoding microbenchmark
+ *
+ *      Builds replies with DHCPSend for a client which lists every known
+ *      option in option 55, from a range with a full reply template and a
+ *      few options set for the request. Replies are queued into a batch
+ *      which is never flushed, so only encoding is measured.
+ *
+ *      make bench && bench/replybench ?count?
+ */
+
+#include "../nsdhcpd.c"
+
+#define BENCH_TEMPLATE                   360
+
+/* Options the reply gets anyway or which would change the packet layout */
+static int BenchSkip(int code)
+{
+    switch (code) {
+    case DHCP_OPTION_OVERLOAD:
+    case DHCP_MESSAGE_TYPE:
+    case DHCP_SERVER_IDENTIFIER:
+    case DHCP_PARAMETER_REQUEST_LIST:
+    case DHCP_MAX_MESSAGE_SIZE:
+    case DHCP_VENDOR_CLASS_IDENTIFIER:
+    case DHCP_AGENT_OPTIONS:
+        return 1;
+    }
+    return main_dict[code].name == NULL || main_dict[code].next != NULL;
+}
+
+static DHCPOption *BenchOption(int code)
+{
+    char value[32];
+
+    switch (main_dict[code].flags & 0x00ff) {
+    case OPTION_IPADDR:
+        strcpy(value, "10.0.0.2");
+        break;
+    case OPTION_STRING:
+        sprintf(value, "bench-%d", code);
+        break;
+    default:
+        strcpy(value, "1");
+    }
+    return DHCPOptionCreate(main_dict[code].name, value);
+}
+
+static DHCPRequest *BenchRequest(DHCPServer *srvPtr, DHCPRange *range, DHCPBatch *batch, int params)
+{
+    int code;
+    u_int8_t *ptr, *size;
+    DHCPOption *opt;
+    DHCPRequest *req = (DHCPRequest*)DHCPSlabAlloc(SLAB_REQUEST);
+
+    req->srvPtr = srvPtr;
+    req->range = range;
+    req->batch = batch;
+    req->in.op = BOOTREQUEST;
+    req->in.htype = ETH_10MB;
+    req->in.hlen = ETH_10MB_LEN;
+    req->in.cookie = htonl(DHCP_MAGIC);
+
+    ptr = req->in.options;
+    *ptr++ = DHCP_MESSAGE_TYPE;
+    *ptr++ = 1;
+    *ptr++ = DHCP_DISCOVER;
+    if (params) {
+        // Reverse order so the request order differs from the template order
+        *ptr++ = DHCP_PARAMETER_REQUEST_LIST;
+        size = ptr++;
+        *size = 0;
+        for (code = DHCP_END - 1; code > 0; code--) {
+            *ptr++ = code;
+            (*size)++;
+        }
+    }
+    *ptr++ = DHCP_END;
+    DHCPRequestIndex(req);
+
+    // Options set by the proc take precedence over the template
+    for (code = 1; code < 16; code++) {
+        if (!BenchSkip(code) && (opt = BenchOption(code)) != NULL) {
+            opt->next = req->reply.options;
+            req->reply.options = opt;
+        }
+    }
+    req->reply.yiaddr = inet_addr("10.0.0.10");
+    req->reply.netmask = inet_addr("255.255.255.0");
+    req->reply.gateway = inet_addr("10.0.0.1");
+    req->reply.lease_time = 3600;
+    return req;
+}
+
+static void BenchRun(const char *label, DHCPRequest *req, int count)
+{
+    int i;
+    double ns;
+    Ns_Time start, end;
+
+    Ns_GetTime(&start);
+    for (i = 0; i < count; i++) {
+        req->parser.ptr = req->out.options;
+        req->parser.end = req->out.options + OPTION_SIZE;
+        req->batch->nqueued = 0;
+        req->queued = 0;
+        DHCPSend(req, DHCP_OFFER);
+    }
+    Ns_GetTime(&end);
+    ns = (end.sec - start.sec) * 1e9 + (end.usec - start.usec) * 1e3;
+    printf("%-16s %d replies, %d option bytes, %.1f ns/reply\n", label, count,
+           (int)(req->parser.ptr - req->out.options), ns / count);
+}
+
+int main(int argc, char **argv)
+{
+    int code, size = 0, count = argc > 1 ? atoi(argv[1]) : 1000000;
+    DHCPServer server;
+    DHCPRange range;
+    DHCPBatch batch;
+    struct iovec iov;
+    struct sockaddr_in to;
+    DHCPOption *opt;
+    DHCPRangeOptions *options;
+
+    DHCPGlobalInit();
+
+    memset(&server, 0, sizeof(server));
+    server.name = "bench";
+    server.ipaddr.sin_addr.s_addr = inet_addr("10.0.0.1");
+
+    // Template as large as fits into the reply next to the request options
+    options = ns_calloc(1, sizeof(DHCPRangeOptions));
+    for (code = 1; code < DHCP_END && size < BENCH_TEMPLATE; code++) {
+        if (!BenchSkip(code) && (opt = BenchOption(code)) != NULL) {
+            opt->next = options->reply;
+            options->reply = opt;
+            size += opt->size + 2;
+        }
+    }
+    DHCPRangeOptionsCompile(options);
+
+    memset(&range, 0, sizeof(range));
+    range.srvPtr = &server;
+    range.options = options;
+
+    // Batch of one which is reset before it would be sent
+    memset(&batch, 0, sizeof(batch));
+    batch.srvPtr = &server;
+    batch.size = 1;
+    batch.flush = 2;
+    batch.to = &to;
+    batch.iov = &iov;
+
+    printf("range template %d bytes\n", options->tlv.size);
+    BenchRun("option 55", BenchRequest(&server, &range, &batch, 1), count);
+    BenchRun("no option 55", BenchRequest(&server, &range, &batch, 0), count);
+    return 0;
+}
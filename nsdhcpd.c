@@ -32,8 +32,15 @@
  *     Vlad Seryakov vlad@crystalballinc.com
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE                     /* recvmmsg/sendmmsg */
+#endif
+
 #include "ns.h"
+#include "nsdhcpd.h"
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -41,10 +48,14 @@
 #include <sys/time.h>
 #include <netdb.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/syslog.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <netinet/in_systm.h>
@@ -53,6 +64,10 @@
 #include <netinet/ip_icmp.h>
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #define DHCP_PADDING                     0
 #define DHCP_SUBNET_MASK                 1
@@ -125,6 +140,7 @@
 #define DHCP_USER_CLASS                  77
 #define DHCP_FQDN                        81
 #define DHCP_AGENT_OPTIONS               82
+#define DHCP_AGENT_CIRCUIT_ID            1
 #define DHCP_SUBNET_SELECTION            118
 #define DHCP_END                         255
 
@@ -158,6 +174,48 @@
 
 #define OPTION_SIZE                      512
 
+#define WHEEL_BITS                       6
+#define WHEEL_SIZE                       (1 << WHEEL_BITS)
+#define WHEEL_MASK                       (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS                     4
+
+#define STORAGE_HASH                     0
+#define STORAGE_DENSE                    1
+
+#define INDEX_STRIPES                    16
+
+#define LEASE_FREE                       0
+#define LEASE_ACTIVE                     1
+
+#define LEASE_MACADDR                    0x01
+
+#define JOURNAL_MAGIC                    "NSDHCPJ1"
+#define JOURNAL_CREATE                   1
+#define JOURNAL_RENEW                    2
+#define JOURNAL_DELETE                   3
+
+#define SNAPSHOT_MAGIC                   "NSDHCPS1"
+#define SNAPSHOT_VERSION                 1
+
+#define SLAB_LEASE                       0
+#define SLAB_OPTION                      1
+#define SLAB_REQUEST                     2
+#define SLAB_TYPES                       3
+#define SLAB_CHUNK                       64
+#define SLAB_CACHE                       256
+#define SLAB_ALIGN(size)                 (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+#define BATCH_MAX                        1024
+
+#define PAD_NONE                         0
+#define PAD_BOOTP                        1
+#define PAD_MAXSIZE                      2
+#define BOOTP_MIN_SIZE                   300
+#define UDP_HEADERS_SIZE                 28
+
+#define BITMAP_SET(map, n)               ((map)[(n) >> 5] |= (1U << ((n) & 31)))
+#define BITMAP_ISSET(map, n)             ((map)[(n) >> 5] & (1U << ((n) & 31)))
+
 #define OPTION_LIST                      0x1000
 #define OPTION_BOOLEAN                   1
 #define OPTION_U8                        2
@@ -190,44 +248,303 @@ typedef struct _dhcpOption {
     } value;
 } DHCPOption;
 
-typedef struct _dhcpRange {
-    struct _dhcpRange *next;
+/* Range options, never modified once published, rangeupdate replaces them */
+typedef struct _dhcpRangeOptions {
     DHCPOption *check;
     DHCPOption *reply;
-    u_int32_t start;
-    u_int32_t end;
     char macaddr[13];
-    u_int32_t lease_time;
-    Tcl_HashTable leases;
+    struct {
+      u_int8_t *data;           /* reply options encoded as ready to send TLVs */
+      int size;
+      u_int16_t offset[256];    /* position of each option code in data */
+      u_int16_t length[256];    /* size of the TLV with header, 0 if not present */
+    } tlv;
+} DHCPRangeOptions;
+
+/* Stripe of the range index, MAC address and client id map to leased address */
+typedef struct _dhcpIndex {
     Ns_Mutex lock;
+    Tcl_HashTable macaddrs;
+    Tcl_HashTable clientids;
+} DHCPIndex;
+
+/* Independently locked block of consecutive addresses of a range */
+typedef struct _dhcpShard {
+    Ns_Mutex lock;
+    u_int32_t start;            /* first address, host byte order */
+    u_int32_t end;              /* last address, host byte order */
+    Tcl_HashTable leases;
+    Tcl_HashTable clientids;    /* dense storage, client ids by address */
+    struct {
+      u_int32_t *bits;          /* one bit per address, set when leased */
+      u_int32_t words;
+      u_int32_t next;           /* next-fit cursor, word index */
+      u_int32_t nfree;
+    } pool;
+} DHCPShard;
+
+typedef struct _dhcpRange {
+    struct _dhcpServer *srvPtr;
+    DHCPRangeOptions *options;
+    u_int32_t start;            /* first address, host byte order */
+    u_int32_t end;              /* last address, host byte order */
+    u_int32_t lease_time;
+    struct _dhcpLeaseRecord *records;  /* dense storage, indexed by address - start */
+    int loading;                /* leases restored from the journal are not written back */
+    int dead;                   /* unlinked, set under all shard locks, no new leases */
+    int nshards;
+    u_int32_t shardsize;        /* addresses per shard, the last one may be smaller */
+    unsigned int nextshard;     /* first shard tried by the next allocation */
+    DHCPShard *shards;
+    DHCPIndex index[INDEX_STRIPES];   /* stripe is selected by hash of the key */
 } DHCPRange;
 
+/* Range pinned to a MAC address, the address is copied so the table stays consistent */
+typedef struct _dhcpRangePin {
+    char macaddr[13];
+    DHCPRange *range;
+} DHCPRangePin;
+
+/* Immutable set of ranges, replaced as a whole on every range change */
+typedef struct _dhcpRangeTable {
+    int count;
+    int npinned;
+    DHCPRange **items;          /* sorted by start address */
+    DHCPRangePin *pinned;       /* sorted by MAC address */
+    int ncodes;
+    u_int16_t *codes;           /* code | subcode << 8 of first check rules */
+    Tcl_HashTable *classes;     /* first check rule and value -> DHCPRangeClass */
+} DHCPRangeTable;
+
+/* Ranges which first check rule has the same option value, in table order */
+typedef struct _dhcpRangeClass {
+    int count;
+    DHCPRange *items[1];
+} DHCPRangeClass;
+
+/* Per thread reader slot for epoch based reclamation */
+typedef struct _dhcpReader {
+    struct _dhcpReader *next;
+    struct _dhcpServer *srvPtr;
+    u_int64_t epoch;            /* epoch seen on entry, 0 outside of a read section */
+    int depth;
+    int inuse;
+} DHCPReader;
+
+/* Objects unlinked by a writer, freed once no reader can see them */
+typedef struct _dhcpRetired {
+    struct _dhcpRetired *next;
+    u_int64_t epoch;
+    DHCPRangeTable *table;
+    DHCPRange *range;
+    DHCPRangeOptions *options;
+} DHCPRetired;
+
 typedef struct _dhcpLease {
     u_int32_t lease_time;
     u_int32_t expires;
     u_int32_t ipaddr;
     char macaddr[13];
+    char *clientid;
+    u_int32_t scheduled;        /* expiration time of the pending timer */
 } DHCPLease;
 
+/* Compact lease for dense ranges, address is implied by the position */
+typedef struct _dhcpLeaseRecord {
+    u_int8_t macaddr[6];
+    u_int8_t state;
+    u_int8_t flags;
+    u_int32_t expires;
+    u_int32_t lease_time;
+} DHCPLeaseRecord;
+
+/* Journal record, followed by idlen bytes of client id */
+typedef struct _dhcpJournalRecord {
+    u_int32_t checksum;
+    u_int8_t type;
+    u_int8_t flags;
+    u_int8_t macaddr[6];
+    u_int32_t ipaddr;
+    u_int32_t lease_time;
+    u_int32_t expires;
+    u_int16_t idlen;
+    u_int16_t unused;
+} DHCPJournalRecord;
+
+typedef struct _dhcpJournalEntry {
+    DHCPJournalRecord rec;
+    char *clientid;
+    int consumed;
+} DHCPJournalEntry;
+
+/* Snapshot file header, followed by sorted records and client id strings */
+typedef struct _dhcpSnapshotHeader {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t recsize;
+    u_int32_t count;
+    u_int32_t strsize;
+    u_int32_t created;
+    u_int32_t unused;
+} DHCPSnapshotHeader;
+
+typedef struct _dhcpSnapshotRecord {
+    u_int32_t ipaddr;
+    u_int32_t expires;
+    u_int32_t lease_time;
+    u_int32_t idoff;            /* client id offset in the string area, 0 if none */
+    u_int8_t macaddr[6];
+    u_int8_t flags;
+    u_int8_t unused;
+} DHCPSnapshotRecord;
+
+typedef struct _dhcpSnapshot {
+    void *addr;
+    size_t size;
+    u_int32_t count;
+    u_int32_t strsize;
+    DHCPSnapshotRecord *records;
+    char *strings;
+} DHCPSnapshot;
+
+typedef struct _dhcpTimer {
+    struct _dhcpTimer *next;
+    u_int32_t ipaddr;
+    u_int32_t expires;
+} DHCPTimer;
+
 typedef struct _dhcpServer {
     int port;
     char *name;
     char *run_proc;
+    char *procs[DHCP_INFORM + 1]; /* script per message type, run_proc unless configured */
     char *trace_proc;
+    char scripts[64];           /* interp AssocData key of compiled scripts */
     char *address;
     char *interface;
     int sock;
     int debug;
     int drivermode;
+    int padding;                /* PAD_NONE, PAD_BOOTP or PAD_MAXSIZE */
+    int dense_max;              /* max addresses of a dense range */
     struct sockaddr_in ipaddr;
     struct {
       int sock;
       int port;
     } client;
-    Ns_Mutex lock;
-    DHCPRange *ranges;
+    Ns_Mutex lock;              /* serializes range table writers */
+    DHCPRangeTable *ranges;     /* current table, read without locking */
+    struct {
+      Ns_Tls tls;
+      u_int64_t epoch;
+      DHCPReader *readers;
+      DHCPRetired *retired;
+    } rcu;
+    struct {
+      Ns_Mutex lock;
+      Ns_Cond cond;
+      int shutdown;
+      int stopped;
+      int interval;
+      int batch;
+      char *proc;
+      u_int32_t now;            /* next second to be processed by the wheel */
+      DHCPTimer *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+    } expire;
+    struct {
+      Ns_Mutex lock;
+      Ns_Cond cond;
+      char *path;
+      int fd;
+      int shutdown;
+      int stopped;
+      int compact;              /* compaction interval in seconds */
+      time_t compacted;
+      Ns_DString buffer;        /* records waiting for the writer thread */
+      int npending;
+      DHCPJournalEntry *pending; /* replayed leases waiting for their range */
+    } journal;
+    struct {
+      char *path;
+      DHCPSnapshot map;         /* mapped at startup, used by rangeadd */
+    } snapshot;
+    struct {
+      int size;                 /* datagrams drained per wakeup, 1 disables batching */
+      int flush;                /* queued replies which force a flush */
+      struct _dhcpBatch *ptr;   /* used by the socket callback thread */
+    } batch;
+    struct {
+      int threads;              /* SO_REUSEPORT sockets with own thread each, 0 uses socket callback */
+      int pin;                  /* bind listener threads to cpus */
+      Ns_Mutex lock;
+      Ns_Cond cond;
+      int shutdown;
+      int running;
+      struct _dhcpListener *list;
+    } listen;
+    struct {
+      int threads;              /* driver mode workers, 0 dispatches through connection threads */
+      int size;                 /* requests which can be queued */
+      Ns_Mutex lock;
+      Ns_Cond cond;
+      int shutdown;
+      int running;
+      u_int64_t dropped;        /* packets received while all requests were queued */
+      struct _dhcpRequest *free;
+      struct _dhcpRequest *head;
+      struct _dhcpRequest *tail;
+    } workers;
+    struct {
+      int threads;              /* trace_proc threads, 0 runs trace_proc after every reply */
+      int size;                 /* maximum number of waiting events */
+      int batch;                /* events processed with one interp allocation */
+      Ns_Mutex lock;
+      Ns_Cond cond;
+      int shutdown;
+      int running;
+      int count;
+      u_int64_t queued;
+      u_int64_t dropped;
+      u_int64_t processed;
+      struct _dhcpRequest *head;
+      struct _dhcpRequest *tail;
+    } trace;
+    struct {
+      int count;
+      Ns_DhcpPlugin *list;      /* native policy hooks, called before run_proc */
+    } plugins;
+    struct {
+      int nvendor;
+      int ncircuit;
+      CONST char **vendor;      /* glob patterns of vendor class identifier */
+      CONST char **circuit;     /* glob patterns of relay agent circuit-id */
+    } filter;
 } DHCPServer;
 
+/* Objects of one type, carved from chunks which are never returned to the system */
+typedef struct _dhcpSlab {
+    const char *name;
+    size_t size;
+    void *free;                 /* shared free list, protected by slabLock */
+    u_int32_t nfree;
+    u_int32_t total;
+    u_int32_t slabs;
+} DHCPSlab;
+
+/* Per thread free lists, no locking on the fast path */
+typedef struct _dhcpSlabCache {
+    struct _dhcpSlabCache *next;
+    void *free[SLAB_TYPES];
+    u_int32_t nfree[SLAB_TYPES];
+} DHCPSlabCache;
+
+typedef struct _dhcpExpireBatch {
+    DHCPServer *srvPtr;
+    Tcl_Interp *interp;
+    Tcl_Obj *list;
+    int count;
+} DHCPExpireBatch;
+
 typedef struct _dhcpPacket {
     u_int8_t op;
     u_int8_t htype;
@@ -248,16 +565,22 @@ typedef struct _dhcpPacket {
 } DHCPPacket;
 
 typedef struct _dhcpRequest {
-    DHCPPacket in;
     DHCPPacket out;
     DHCPServer *srvPtr;
     struct sockaddr_in sa;
-    int sock;
+    int sock;                   /* shared listening socket, never closed by the request */
     int size;
-    char *buffer;
+    int cached;                 /* per-thread object, not returned to the slab */
+    int queued;                 /* reply is waiting in the batch */
+    struct _dhcpBatch *batch;   /* replies are queued instead of sent */
+    struct _dhcpRequest *nextPtr; /* worker queue, trace queue or free list */
+    u_int32_t rangestart;       /* range of a trace event, looked up again by trace threads */
+    int leased;                 /* lease below was looked up, trace events keep the snapshot */
+    DHCPLease lease;            /* lease of the reply address */
     u_int8_t msgtype;
     DHCPRange *range;
     char macaddr[13];
+    char clientid[512];
     struct {
       u_int8_t msgtype;
       u_int32_t yiaddr;
@@ -273,21 +596,105 @@ typedef struct _dhcpRequest {
       u_int8_t *ptr;
       u_int8_t *end;
     } parser;
+    struct {
+      u_int16_t offset[256];    /* option data offset into the packet, 0 if not present */
+      u_int8_t size[256];
+      u_int16_t agent[256];     /* same for relay agent sub-options */
+      u_int8_t agentsize[256];
+    } index;
+    DHCPPacket in;              /* datagrams are received here in place */
+    u_int8_t overflow[2];       /* room to detect oversized packets and the terminating zero */
 } DHCPRequest;
 
+/* Datagrams received and replies sent together by the socket callback */
+typedef struct _dhcpBatch {
+    DHCPServer *srvPtr;
+    NS_SOCKET sock;
+    int size;
+    int flush;
+    int nqueued;
+    DHCPRequest **reqs;         /* receive areas, one request per datagram */
+    int *lengths;
+    struct sockaddr_in *from;
+    struct sockaddr_in *to;
+    struct iovec *iov;          /* replies point into req->out */
+#ifdef __linux__
+    struct mmsghdr *rmsgs;
+    struct iovec *riov;
+    struct mmsghdr *smsgs;
+#endif
+} DHCPBatch;
+
+/* One of the SO_REUSEPORT sockets with its thread and request buffers */
+typedef struct _dhcpListener {
+    DHCPServer *srvPtr;
+    NS_SOCKET sock;
+    int id;
+    DHCPBatch *batch;
+} DHCPListener;
+
+/* Script objects of one interp, Tcl keeps their bytecode between requests */
+typedef struct _dhcpScripts {
+    Tcl_Obj *run[DHCP_INFORM + 1]; /* same object for types sharing the script */
+    Tcl_Obj *trace;
+} DHCPScripts;
+
+static void DHCPGlobalInit(void);
 static Ns_SockProc DHCPSockProc;
 static Ns_DriverProc DHCPDriverProc;
 static int DHCPInterpInit(Tcl_Interp * interp, void *arg);
 static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONST objv[]);
 static DHCPRequest *DHCPRequestCreate(DHCPServer *srvPtr, NS_SOCKET sock, char *buffer, int size, struct sockaddr_in *sa);
+static DHCPRequest *DHCPRequestInit(DHCPRequest *req, DHCPServer *srvPtr, NS_SOCKET sock, int size, struct sockaddr_in *sa);
+static DHCPRequest *DHCPRequestThread(void);
+static Tcl_Obj *DHCPRequestDict(DHCPRequest *req, Tcl_Obj *names);
+static Tcl_Obj *DHCPRequestField(DHCPRequest *req, const char *name);
+static DHCPLease *DHCPRequestLease(DHCPRequest *req);
+static int DHCPRequestSet(Tcl_Interp *interp, DHCPRequest *req, char *name, char *value);
+static void DHCPRequestCleanup(void *arg);
+static DHCPScripts *DHCPScriptsGet(DHCPServer *srvPtr, Tcl_Interp *interp);
+static void DHCPScriptsFree(ClientData arg, Tcl_Interp *interp);
+static void DHCPSockRead(DHCPServer *srvPtr, NS_SOCKET sock, DHCPBatch *batch);
+static int DHCPListenInit(DHCPServer *srvPtr);
+static void DHCPListenThread(void *arg);
+static void DHCPListenShutdown(const Ns_Time *toPtr, void *arg);
+static void DHCPWorkerInit(DHCPServer *srvPtr);
+static void DHCPWorkerRecv(DHCPServer *srvPtr, NS_SOCKET sock);
+static void DHCPWorkerThread(void *arg);
+static void DHCPWorkerShutdown(const Ns_Time *toPtr, void *arg);
+static void DHCPTraceQueue(DHCPRequest *req);
+static void DHCPTraceThread(void *arg);
+static void DHCPTraceShutdown(const Ns_Time *toPtr, void *arg);
+static void DHCPTraceStats(DHCPServer *srvPtr, Ns_DString *ds);
+static int DHCPPluginInit(DHCPServer *srvPtr, const char *server, const char *module, char *list);
+static void DHCPPluginRequest(DHCPRequest *req);
+static void DHCPPluginReply(DHCPRequest *req);
+static int DHCPFilterInit(const char *module, const char *name, char *value, CONST char ***list);
+static int DHCPFilterMatch(DHCPRequest *req);
+static int DHCPPluginMsgType(Ns_DhcpRequest *req);
+static const char *DHCPPluginMacaddr(Ns_DhcpRequest *req);
+static const char *DHCPPluginClientid(Ns_DhcpRequest *req);
+static u_int32_t DHCPPluginGet(Ns_DhcpRequest *req, int field);
+static void DHCPPluginSet(Ns_DhcpRequest *req, int field, u_int32_t value);
+static const u_int8_t *DHCPPluginOption(Ns_DhcpRequest *req, int code, int subcode, int *size);
+static int DHCPPluginSetOption(Ns_DhcpRequest *req, const char *name, const char *value);
+static int DHCPPluginSetRange(Ns_DhcpRequest *req, u_int32_t ipaddr);
+static int DHCPPluginRange(Ns_DhcpRequest *req, u_int32_t *start, u_int32_t *end);
+static DHCPBatch *DHCPBatchCreate(DHCPServer *srvPtr, NS_SOCKET sock, int size, int flush);
+static void DHCPBatchProcess(DHCPBatch *batch);
+static int DHCPBatchRecv(DHCPBatch *batch);
+static void DHCPBatchQueue(DHCPBatch *batch, DHCPRequest *req, struct sockaddr_in *sa, int size);
+static void DHCPBatchFlush(DHCPBatch *batch);
 static int DHCPRequestProc(void *arg, Ns_Conn *conn);
 static int DHCPRequestProcess(DHCPRequest *req);
 static void DHCPRequestFree(DHCPRequest *req);
 static int DHCPRequestRead(DHCPServer *srvPtr, NS_SOCKET sock, char *buffer, int size, struct sockaddr_in *sa);
 static int DHCPRequestReply(DHCPRequest *req);
+static int DHCPRequestLength(DHCPRequest *req);
 static void DHCPPrintRequest(Ns_DString *ds, DHCPRequest *req, int reply);
 static void DHCPPrintOptions(Ns_DString *ds, DHCPPacket *pkt, u_int8_t *ptr, int length, DHCPDict *info);
 static void DHCPPrintValue(Ns_DString *ds, char *name, u_int8_t type, u_int8_t size, u_int8_t *data);
+static Tcl_Obj *DHCPValueObj(unsigned int flags, u_int8_t size, u_int8_t *data);
 static int DHCPRequestSend(DHCPRequest *req, u_int32_t ipaddr, int port);
 static void DHCPProcessDiscover(DHCPRequest *req);
 static void DHCPProcessRequest(DHCPRequest *req);
@@ -297,26 +704,106 @@ static void DHCPSend(DHCPRequest *req, u_int8_t type);
 static void DHCPSendNAK(DHCPRequest *req);
 static DHCPRange *DHCPRangeFind(DHCPRequest *req);
 static DHCPRange *DHCPRangeFindFast(DHCPServer *srvPtr, u_int32_t ipaddr);
+static DHCPRange *DHCPRangeCheck(DHCPRequest *req, DHCPRange *range);
+static DHCPRange *DHCPRangeClassify(DHCPRequest *req, DHCPRangeTable *table);
+static void DHCPRangeTableClasses(DHCPRangeTable *table);
+static char *DHCPRangeClassKey(char *buf, DHCPOption *opt);
+static int DHCPRangeSearch(DHCPRangeTable *table, u_int32_t ipaddr);
+static int DHCPRangeLink(DHCPServer *srvPtr, DHCPRange *range);
+static int DHCPRangeUnlink(DHCPServer *srvPtr, u_int32_t start);
+static int DHCPRangeUpdate(DHCPServer *srvPtr, Tcl_Interp *interp, u_int32_t start, char *check, char *reply, char *macaddr);
+static DHCPRangeTable *DHCPRangeEnter(DHCPServer *srvPtr);
+static void DHCPRangeLeave(DHCPServer *srvPtr);
+static void DHCPRangeRetire(DHCPServer *srvPtr, DHCPRangeTable *table, DHCPRange *range, DHCPRangeOptions *options);
+static DHCPRangeTable *DHCPRangeTableCopy(DHCPRangeTable *table, DHCPRange *add, DHCPRange *del);
+static void DHCPRangeTableFree(DHCPRangeTable *table);
+static int DHCPRangeTableCmp(const void *a, const void *b);
+static int DHCPRangePinCmp(const void *a, const void *b);
+static DHCPRangeOptions *DHCPRangeOptionsCreate(Tcl_Interp *interp, char *check, char *reply, char *macaddr, DHCPRangeOptions *base);
+static void DHCPRangeOptionsFree(DHCPRangeOptions *options);
+static void DHCPRangeOptionsCompile(DHCPRangeOptions *options);
+static void DHCPReaderCleanup(void *arg);
 static void DHCPRangeList(DHCPRange *range, Ns_DString *ds);
 static void DHCPRangeFree(DHCPRange *range);
-static DHCPLease *DHCPLeaseCreate(u_int32_t ipaddr, char *macaddr, u_int32_t lease_time, u_int32_t expires);
-static DHCPLease *DHCPLeaseFind(DHCPRange *range, u_int32_t ipaddr, char *macaddr);
-static DHCPLease *DHCPLeaseAlloc(DHCPRange *range);
-static int DHCPLeaseAdd(DHCPServer *srvPtr, u_int32_t ipaddr, char *macaddr, u_int32_t lease_time, u_int32_t expires);
+static void DHCPShardInit(DHCPRange *range, int nshards);
+static DHCPShard *DHCPShardGet(DHCPRange *range, u_int32_t ipaddr);
+static void DHCPRangeLock(DHCPRange *range);
+static void DHCPRangeUnlock(DHCPRange *range);
+static void DHCPPoolInit(DHCPShard *shard);
+static void DHCPPoolSet(DHCPShard *shard, u_int32_t ipaddr, int used);
+static int DHCPPoolAlloc(DHCPShard *shard, u_int32_t *ipaddr);
+static void DHCPLeaseCreate(DHCPRange *range, u_int32_t ipaddr, char *macaddr, char *clientid, u_int32_t lease_time, u_int32_t expires);
+static DHCPLease *DHCPLeaseGet(DHCPRange *range, u_int32_t ipaddr, DHCPLease *lease, Ns_DString *clientid);
+static void DHCPLeaseFree(DHCPRange *range, u_int32_t ipaddr);
+static DHCPLease *DHCPLeaseFind(DHCPRange *range, u_int32_t ipaddr, char *macaddr, char *clientid, DHCPLease *lease);
+static DHCPLease *DHCPLeaseAlloc(DHCPRange *range, char *macaddr, char *clientid, DHCPLease *lease);
+static int DHCPLeaseReclaim(DHCPExpireBatch *batch, DHCPRange *range, DHCPShard *shard, u_int32_t now);
+static void DHCPLeaseRenew(DHCPRange *range, u_int32_t ipaddr, u_int32_t expires);
+static int DHCPLeaseAdd(DHCPServer *srvPtr, u_int32_t ipaddr, char *macaddr, char *clientid, u_int32_t lease_time, u_int32_t expires);
 static void DHCPLeaseDel(DHCPServer *srvPtr, u_int32_t ipaddr);
 static void DHCPLeaseList(DHCPRange *range, Ns_DString *ds);
+static void DHCPIndexInit(DHCPRange *range);
+static DHCPIndex *DHCPIndexGet(DHCPRange *range, const char *key);
+static void DHCPIndexSet(DHCPRange *range, u_int32_t ipaddr, char *macaddr, char *clientid);
+static void DHCPIndexUnset(DHCPRange *range, u_int32_t ipaddr, char *macaddr, char *clientid);
+static u_int32_t DHCPIndexFind(DHCPRange *range, char *macaddr, char *clientid);
+static void DHCPExpireSchedule(DHCPServer *srvPtr, u_int32_t ipaddr, u_int32_t expires);
+static void DHCPExpireAdd(DHCPServer *srvPtr, DHCPTimer *timer);
+static DHCPTimer *DHCPExpireCollect(DHCPServer *srvPtr, u_int32_t now);
+static void DHCPExpireProcess(DHCPExpireBatch *batch, DHCPTimer *timers, u_int32_t now);
+static void DHCPExpireSweep(DHCPExpireBatch *batch, DHCPRange *range, u_int32_t now);
+static int DHCPExpireAppend(DHCPExpireBatch *batch, DHCPLease *lease, char *clientid);
+static void DHCPExpireFlush(DHCPExpireBatch *batch);
+static void DHCPExpireThread(void *arg);
+static void DHCPExpireShutdown(const Ns_Time *toPtr, void *arg);
+static int DHCPJournalInit(DHCPServer *srvPtr);
+static int DHCPJournalCmp(const void *a, const void *b);
+static u_int32_t DHCPJournalChecksum(DHCPJournalRecord *rec, char *clientid);
+static void DHCPJournalEncode(Ns_DString *ds, u_int8_t type, DHCPLease *lease, char *clientid);
+static void DHCPJournalWrite(DHCPServer *srvPtr, u_int8_t type, u_int32_t ipaddr, char *macaddr, char *clientid, u_int32_t lease_time, u_int32_t expires);
+static void DHCPJournalLoad(DHCPServer *srvPtr, DHCPRange *range);
+static void DHCPJournalConsume(DHCPServer *srvPtr, DHCPRange *range);
+static int DHCPJournalFirst(DHCPServer *srvPtr, u_int32_t start);
+static int DHCPJournalCompact(DHCPServer *srvPtr);
+static void DHCPJournalThread(void *arg);
+static void DHCPJournalShutdown(const Ns_Time *toPtr, void *arg);
+static int DHCPSnapshotOpen(char *path, DHCPSnapshot *snap);
+static void DHCPSnapshotClose(DHCPSnapshot *snap);
+static int DHCPSnapshotLoad(DHCPServer *srvPtr, DHCPSnapshot *snap, DHCPRange *range);
+static int DHCPSnapshotCmp(const void *a, const void *b);
+static void DHCPSnapshotAppend(Ns_DString *records, Ns_DString *strings, DHCPLease *lease, char *clientid);
+static int DHCPSnapshotSave(DHCPServer *srvPtr, char *path);
+static void *DHCPSlabAlloc(int type);
+static void DHCPSlabFree(int type, void *obj);
+static DHCPSlabCache *DHCPSlabGetCache(void);
+static void DHCPSlabRelease(DHCPSlabCache *cache, int type, u_int32_t count);
+static void DHCPSlabCleanup(void *arg);
+static void DHCPSlabStats(Ns_DString *ds);
 static DHCPOption *DHCPOptionCreate(const char *name, const char *value);
+static DHCPOption *DHCPOptionCopy(DHCPOption *opt);
+static void DHCPOptionFree(DHCPOption *opt);
 static char *addr2str(u_int32_t addr);
 static char *str2mac(char *macaddr, char *str);
 static char *bin2hex(char *buf, u_int8_t *macaddr, int numbytes);
+static char *bin2str(char *buf, u_int8_t *bin, int size);
 static u_int8_t *hex2bin(u_int8_t *buf, char *hex, int size);
 static u_int8_t *getOption(DHCPPacket *pkt, u_int8_t code, u_int8_t subcode, DHCPOption *val);
+static void getOptionValue(DHCPDict *dict, u_int8_t *data, int size, DHCPOption *opt);
+static void DHCPRequestIndex(DHCPRequest *req);
+static u_int8_t *DHCPRequestOption(DHCPRequest *req, u_int8_t code, u_int8_t subcode, DHCPOption *opt);
 static void addOption(DHCPRequest *req, u_int8_t code, u_int8_t size, void *data);
+static void addOptionData(DHCPRequest *req, u_int8_t *data, int size);
+static void addOptionValue(DHCPRequest *req, DHCPOption *opt);
+static u_int8_t *getOptionData(DHCPOption *opt, u_int8_t *buf);
 static void addOption8(DHCPRequest *req, u_int8_t code, u_int8_t data);
 static void addOption16(DHCPRequest *req, u_int8_t code, u_int16_t data);
 static void addOption32(DHCPRequest *req, u_int8_t code, u_int32_t data);
 static void addOptionIP(DHCPRequest *req, u_int8_t code, u_int32_t ipaddr);
 static DHCPDict *getDict(const char *name);
+static void DHCPDictInit(void);
+static void DHCPDictSet(DHCPDict *dict);
+static int isGenericName(const char *name);
+static int DHCPDictAdd(Tcl_Interp *interp, char *name, int code, int subcode, char *type, int list);
 static u_int8_t getTypeID(const char *type);
 static const char *getTypeName(u_int8_t type);
 static u_int8_t getTypeSize(u_int8_t type);
@@ -325,6 +812,32 @@ static const char *getMessageName(u_int8_t type);
 
 static Ns_Tls reqTls;
 
+static Ns_RWLock dictLock;
+static Tcl_HashTable dictNames;       /* lower case name -> DHCPDict entry */
+static Ns_Tls reqCacheTls;
+
+static Ns_Tls slabTls;
+static Ns_Mutex slabLock;
+static DHCPSlabCache *slabCaches;
+static DHCPSlab slabs[SLAB_TYPES] = {
+    { "lease",   sizeof(DHCPLease) },
+    { "option",  sizeof(DHCPOption) },
+    { "request", sizeof(DHCPRequest) }
+};
+
+static const Ns_DhcpApi pluginApi = {
+    NS_DHCP_PLUGIN_VERSION,
+    DHCPPluginMsgType,
+    DHCPPluginMacaddr,
+    DHCPPluginClientid,
+    DHCPPluginGet,
+    DHCPPluginSet,
+    DHCPPluginOption,
+    DHCPPluginSetOption,
+    DHCPPluginSetRange,
+    DHCPPluginRange
+};
+
 static DHCPDict agent_dict[256] = {
     { "agent.pad",                    0,				         82,          0,  0 },
     { "agent.circuit-id",             OPTION_STRING,				 82,          1,  0 },
@@ -604,6 +1117,12 @@ static Ns_ObjvTable msgtypes[] = {
     { NULL,       0 }
 };
 
+static Ns_ObjvTable storages[] = {
+    { "hash",     STORAGE_HASH },
+    { "dense",    STORAGE_DENSE },
+    { NULL,       0 }
+};
+
 static struct {
     char *key;
     u_int8_t type;
@@ -623,6 +1142,40 @@ static struct {
 
 NS_EXPORT int Ns_ModuleVersion = 1;
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPGlobalInit --
+ *
+ *	Setup thread local storage and dictionaries shared by all servers,
+ *      called once
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPGlobalInit(void)
+{
+    int i;
+
+    Ns_TlsAlloc(&reqTls, NULL);
+    Ns_TlsAlloc(&reqCacheTls, DHCPRequestCleanup);
+    Ns_TlsAlloc(&slabTls, DHCPSlabCleanup);
+    for (i = 0; i < 256; i++) {
+        if (agent_dict[i].name == NULL) {
+            agent_dict[i].code = 82;
+            agent_dict[i].subcode = i;
+            agent_dict[i].flags = OPTION_STRING;
+        }
+    }
+    DHCPDictInit();
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -642,22 +1195,15 @@ NS_EXPORT int Ns_ModuleVersion = 1;
 
 NS_EXPORT int Ns_ModuleInit(const char *server, const char *module)
 {
-    char *path;
+    int i;
+    char *path, *value;
     DHCPServer *srvPtr;
     Ns_DriverInitData init = {0};
     static int first = 0;
 
     if (!first) {
-        int i;
-        Ns_TlsAlloc(&reqTls, NULL);
         first = 1;
-        for (i = 0; i < 256; i++) {
-            if (agent_dict[i].name == NULL) {
-                agent_dict[i].code = i;
-                agent_dict[i].subcode = 82;
-                agent_dict[i].flags = OPTION_STRING;
-            }
-        }
+        DHCPGlobalInit();
     }
 
     path = Ns_ConfigGetPath(server, module, NULL);
@@ -666,10 +1212,56 @@ NS_EXPORT int Ns_ModuleInit(const char *server, const char *module)
     srvPtr->debug = Ns_ConfigIntRange(path, "debug", 0, 0, 65535);
     srvPtr->port = Ns_ConfigIntRange(path, "port", 67, 1, 65535);
     srvPtr->run_proc = Ns_ConfigGetValue(path, "proc");
+    srvPtr->procs[DHCP_DISCOVER] = Ns_ConfigGetValue(path, "discover_proc");
+    srvPtr->procs[DHCP_REQUEST] = Ns_ConfigGetValue(path, "request_proc");
+    srvPtr->procs[DHCP_INFORM] = Ns_ConfigGetValue(path, "inform_proc");
+    srvPtr->procs[DHCP_RELEASE] = Ns_ConfigGetValue(path, "release_proc");
+    srvPtr->procs[DHCP_DECLINE] = Ns_ConfigGetValue(path, "decline_proc");
+    for (i = 0; i <= DHCP_INFORM; i++) {
+        if (srvPtr->procs[i] == NULL) {
+            srvPtr->procs[i] = srvPtr->run_proc;
+        }
+    }
+    srvPtr->filter.nvendor = DHCPFilterInit(module, "filter_vendor", Ns_ConfigGetValue(path, "filter_vendor"), &srvPtr->filter.vendor);
+    srvPtr->filter.ncircuit = DHCPFilterInit(module, "filter_circuit", Ns_ConfigGetValue(path, "filter_circuit"), &srvPtr->filter.circuit);
     srvPtr->trace_proc = Ns_ConfigGetValue(path, "trace_proc");
+    snprintf(srvPtr->scripts, sizeof(srvPtr->scripts), "nsdhcpd:scripts:%p", (void*)srvPtr);
     srvPtr->address = Ns_ConfigGetValue(path, "address");
     srvPtr->drivermode = Ns_ConfigBool(path, "drivermode", 1);
+    value = Ns_ConfigGetValue(path, "padding");
+    if (value == NULL || !strcmp(value, "none")) {
+        srvPtr->padding = PAD_NONE;
+    } else
+    if (!strcmp(value, "bootp")) {
+        srvPtr->padding = PAD_BOOTP;
+    } else
+    if (!strcmp(value, "maxsize")) {
+        srvPtr->padding = PAD_MAXSIZE;
+    } else {
+        Ns_Log(Warning, "%s: unknown padding %s, should be none, bootp or maxsize", module, value);
+    }
     srvPtr->client.port = Ns_ConfigIntRange(path, "client_port", 68, 1, 65535);
+    srvPtr->ranges = ns_calloc(1, sizeof(DHCPRangeTable));
+    srvPtr->rcu.epoch = 1;
+    Ns_TlsAlloc(&srvPtr->rcu.tls, DHCPReaderCleanup);
+    srvPtr->expire.proc = Ns_ConfigGetValue(path, "expire_proc");
+    srvPtr->expire.interval = Ns_ConfigIntRange(path, "expire_interval", 1, 1, 3600);
+    srvPtr->expire.batch = Ns_ConfigIntRange(path, "expire_batch", 1000, 1, INT_MAX);
+    srvPtr->expire.now = time(0);
+    srvPtr->journal.path = Ns_ConfigGetValue(path, "journal");
+    srvPtr->journal.compact = Ns_ConfigIntRange(path, "journal_compact", 3600, 1, INT_MAX);
+    Ns_DStringInit(&srvPtr->journal.buffer);
+    srvPtr->snapshot.path = Ns_ConfigGetValue(path, "snapshot");
+    srvPtr->batch.size = Ns_ConfigIntRange(path, "batch", 1, 1, BATCH_MAX);
+    srvPtr->batch.flush = Ns_ConfigIntRange(path, "batch_flush", srvPtr->batch.size, 1, srvPtr->batch.size);
+    srvPtr->listen.threads = Ns_ConfigIntRange(path, "threads", 0, 0, 1024);
+    srvPtr->listen.pin = Ns_ConfigBool(path, "pin_threads", 1);
+    srvPtr->workers.threads = Ns_ConfigIntRange(path, "driver_workers", 0, 0, 1024);
+    srvPtr->workers.size = Ns_ConfigIntRange(path, "driver_queue", 1024, 1, INT_MAX);
+    srvPtr->trace.threads = Ns_ConfigIntRange(path, "trace_threads", 0, 0, 1024);
+    srvPtr->trace.size = Ns_ConfigIntRange(path, "trace_queue", 10000, 1, INT_MAX);
+    srvPtr->trace.batch = Ns_ConfigIntRange(path, "trace_batch", 100, 1, INT_MAX);
+    srvPtr->dense_max = Ns_ConfigIntRange(path, "dense_max", 1048576, 1, INT_MAX);
 
     if ((Ns_GetSockAddr(&srvPtr->ipaddr, srvPtr->address, srvPtr->port) == NS_ERROR ||
          !strcmp(ns_inet_ntoa(srvPtr->ipaddr.sin_addr), "0.0.0.0")) &&
@@ -679,6 +1271,31 @@ NS_EXPORT int Ns_ModuleInit(const char *server, const char *module)
     }
     Ns_Log(Notice, "%s: server address is %s", module, ns_inet_ntoa(srvPtr->ipaddr.sin_addr));
 
+    /*
+     * Lease snapshot and journal, leases are restored when their ranges are
+     * created, journal records are newer and applied after the snapshot.
+     * Both are read before any thread or socket can refer to the server.
+     */
+
+    if (srvPtr->snapshot.path != NULL && DHCPSnapshotOpen(srvPtr->snapshot.path, &srvPtr->snapshot.map) == NS_OK) {
+        Ns_Log(Notice, "nsdhcpd: %s: mapped snapshot with %u leases", srvPtr->snapshot.path, srvPtr->snapshot.map.count);
+    }
+
+    if (srvPtr->journal.path != NULL && DHCPJournalInit(srvPtr) != NS_OK) {
+        DHCPSnapshotClose(&srvPtr->snapshot.map);
+        ns_free(srvPtr);
+        return NS_ERROR;
+    }
+
+    /*
+     * Native policy plugins, loaded before any request can arrive
+     */
+
+    if (DHCPPluginInit(srvPtr, server, module, Ns_ConfigGetValue(path, "plugins")) != NS_OK) {
+        ns_free(srvPtr);
+        return NS_ERROR;
+    }
+
     /* Configure DHCP listener */
     if (srvPtr->drivermode) {
         init.version = NS_DRIVER_VERSION_1;
@@ -693,6 +1310,22 @@ NS_EXPORT int Ns_ModuleInit(const char *server, const char *module)
             return NS_ERROR;
         }
         Ns_RegisterRequest(server, "DHCP",  "/", DHCPRequestProc, NULL, srvPtr, 0);
+        if (srvPtr->workers.threads > 0) {
+            DHCPWorkerInit(srvPtr);
+            Ns_RegisterAtShutdown(DHCPWorkerShutdown, srvPtr);
+            Ns_Log(Notice, "%s: driver mode with %d workers, queue %d", module, srvPtr->workers.threads, srvPtr->workers.size);
+        }
+
+    } else
+    if (srvPtr->listen.threads > 0) {
+        if (DHCPListenInit(srvPtr) != NS_OK) {
+            ns_free(srvPtr);
+            return NS_ERROR;
+        }
+        Ns_RegisterAtShutdown(DHCPListenShutdown, srvPtr);
+        Ns_Log(Notice, "%s: listening on %s:%d with %d threads and proc <%s>, batch %d/%d", module, srvPtr->address,
+                   srvPtr->port, srvPtr->listen.threads, srvPtr->run_proc ? srvPtr->run_proc : "",
+                   srvPtr->batch.size, srvPtr->batch.flush);
 
     } else {
         srvPtr->sock = Ns_SockListenUdp(srvPtr->address, srvPtr->port, NS_FALSE);
@@ -701,9 +1334,12 @@ NS_EXPORT int Ns_ModuleInit(const char *server, const char *module)
             ns_free(srvPtr);
             return NS_ERROR;
         }
+        if (srvPtr->batch.size > 1) {
+            srvPtr->batch.ptr = DHCPBatchCreate(srvPtr, srvPtr->sock, srvPtr->batch.size, srvPtr->batch.flush);
+        }
         Ns_SockCallback(srvPtr->sock, DHCPSockProc, srvPtr, NS_SOCK_READ | NS_SOCK_EXIT | NS_SOCK_EXCEPTION);
-        Ns_Log(Notice, "%s: listening on %s:%d with proc <%s>", module, srvPtr->address, srvPtr->port,
-                   srvPtr->run_proc ? srvPtr->run_proc : "");
+        Ns_Log(Notice, "%s: listening on %s:%d with proc <%s>, batch %d/%d", module, srvPtr->address, srvPtr->port,
+                   srvPtr->run_proc ? srvPtr->run_proc : "", srvPtr->batch.size, srvPtr->batch.flush);
     }
 
     /*
@@ -713,6 +1349,34 @@ NS_EXPORT int Ns_ModuleInit(const char *server, const char *module)
     if (srvPtr->client.port > 0) {
         srvPtr->client.sock = Ns_SockListenUdp(srvPtr->address, srvPtr->client.port, NS_FALSE);
     }
+    /*
+     * Background thread which retires expired leases
+     */
+
+    Ns_ThreadCreate(DHCPExpireThread, srvPtr, 0, NULL);
+    Ns_RegisterAtShutdown(DHCPExpireShutdown, srvPtr);
+
+    /*
+     * Threads which run trace_proc outside of the reply path
+     */
+
+    if (srvPtr->trace_proc != NULL && srvPtr->trace.threads > 0) {
+        srvPtr->trace.running = srvPtr->trace.threads;
+        for (i = 0; i < srvPtr->trace.threads; i++) {
+            Ns_ThreadCreate(DHCPTraceThread, srvPtr, 0, NULL);
+        }
+        Ns_RegisterAtShutdown(DHCPTraceShutdown, srvPtr);
+    }
+
+    /*
+     * Journal writer, the journal itself was replayed before any listener
+     */
+
+    if (srvPtr->journal.path != NULL) {
+        Ns_ThreadCreate(DHCPJournalThread, srvPtr, 0, NULL);
+        Ns_RegisterAtShutdown(DHCPJournalShutdown, srvPtr);
+    }
+
     Ns_TclRegisterTrace(server, DHCPInterpInit, srvPtr, NS_TCL_TRACE_CREATE);
     return NS_OK;
 }
@@ -761,7 +1425,8 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
     int i, status, cmd;
     DHCPDict *dict;
     DHCPRange *range;
-    DHCPOption *opt, option;
+    DHCPRangeTable *table;
+    DHCPOption option;
     DHCPRequest *req;
     Ns_DString ds;
 
@@ -769,16 +1434,18 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
         cmdDebug, cmdSend,
         cmdDictGet, cmdDictList,
         cmdReqGet, cmdReqSet, cmdReqList,
-        cmdRangeAdd, cmdRangeList,
+        cmdRangeAdd, cmdRangeDel, cmdRangeUpdate, cmdRangeList,
         cmdLeaseList, cmdLeaseAdd, cmdLeaseDel,
-        cmdLeaseFind
+        cmdLeaseFind, cmdSnapshot, cmdSlabStats, cmdDictAdd,
+        cmdTraceStats
     };
     static CONST char *subcmd[] = {
         "debug", "send",
         "dictget", "dictlist",
         "reqget", "reqset", "reqlist",
-        "rangeadd", "rangelist",
+        "rangeadd", "rangedel", "rangeupdate", "rangelist",
         "leaselist", "leaseadd", "leasedel", "leasefind",
+        "snapshot", "slabstats", "dictadd", "tracestats",
         NULL
     };
 
@@ -815,7 +1482,7 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
             return TCL_ERROR;
         }
 
-        req = (DHCPRequest*)ns_calloc(1, sizeof(DHCPRequest));
+        req = (DHCPRequest*)DHCPSlabAlloc(SLAB_REQUEST);
         req->srvPtr = srvPtr;
         req->parser.ptr = req->out.options;
         req->parser.end = req->out.options;
@@ -826,7 +1493,6 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
             req->sa.sin_addr.s_addr = INADDR_BROADCAST;
         } else
         if (Ns_GetSockAddr(&req->sa, ipaddr, port) == NS_ERROR) {
-            (void) ns_sockclose(req->sock);
             DHCPRequestFree(req);
             Tcl_AppendResult(interp, "invalid address ", ipaddr, NULL);
             return TCL_ERROR;
@@ -880,29 +1546,84 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
         break;
     }
 
-    case cmdLeaseAdd:
-        if (objc < 6) {
-            Tcl_WrongNumArgs(interp, 2, objv, "ipaddr macaddr leasetime expires");
+    case cmdLeaseAdd: {
+        int lease_time, expires;
+        char *ipaddr, *mac, *clientid = NULL;
+
+        Ns_ObjvSpec laOpts[] = {
+            {"-clientid",   Ns_ObjvString, &clientid,    NULL },
+            {"--",          Ns_ObjvBreak,  NULL,         NULL },
+            {NULL, NULL, NULL, NULL}
+        };
+        Ns_ObjvSpec laArgs[] = {
+            {"ipaddr",      Ns_ObjvString, &ipaddr,      NULL },
+            {"macaddr",     Ns_ObjvString, &mac,         NULL },
+            {"leasetime",   Ns_ObjvInt,    &lease_time,  NULL },
+            {"expires",     Ns_ObjvInt,    &expires,     NULL },
+            {NULL, NULL, NULL, NULL}
+        };
+
+        if (Ns_ParseObjv(laOpts, laArgs, interp, 2, objc, objv) != NS_OK) {
+            Tcl_AppendResult(interp, "invalid arguments", NULL);
             return TCL_ERROR;
         }
-        str2mac(macaddr, Tcl_GetString(objv[3]));
-        DHCPLeaseAdd(srvPtr, inet_addr(Tcl_GetString(objv[2])), macaddr, atoi(Tcl_GetString(objv[4])), atoi(Tcl_GetString(objv[5])));
+        str2mac(macaddr, mac);
+        DHCPLeaseAdd(srvPtr, inet_addr(ipaddr), macaddr, clientid, lease_time, expires);
         break;
+    }
 
-    case cmdLeaseFind:
-        if (objc < 3) {
-            Tcl_WrongNumArgs(interp, 2, objv, "ipaddr ?macaddr?");
+    case cmdLeaseFind: {
+        u_int32_t addr = 0;
+        char *ipaddr = NULL, *mac = NULL, *clientid = NULL;
+        DHCPLease *lease, buf;
+
+        Ns_ObjvSpec lfOpts[] = {
+            {"-macaddr",    Ns_ObjvString, &mac,         NULL },
+            {"-clientid",   Ns_ObjvString, &clientid,    NULL },
+            {"--",          Ns_ObjvBreak,  NULL,         NULL },
+            {NULL, NULL, NULL, NULL}
+        };
+        Ns_ObjvSpec lfArgs[] = {
+            {"?ipaddr",     Ns_ObjvString, &ipaddr,      NULL },
+            {"?macaddr",    Ns_ObjvString, &mac,         NULL },
+            {NULL, NULL, NULL, NULL}
+        };
+
+        if (Ns_ParseObjv(lfOpts, lfArgs, interp, 2, objc, objv) != NS_OK) {
+            Tcl_AppendResult(interp, "invalid arguments", NULL);
             return TCL_ERROR;
         }
-        range = DHCPRangeFindFast(srvPtr, inet_addr(Tcl_GetString(objv[2])));
-        if (range != NULL) {
-            DHCPLease *lease = DHCPLeaseFind(range, inet_addr(Tcl_GetString(objv[2])), objc > 3 ? Tcl_GetString(objv[3]) : 0);
-            if (lease != NULL) {
-                sprintf(macaddr, "%u %u", lease->lease_time, lease->expires);
-                Tcl_AppendResult(interp, addr2str(lease->ipaddr), " ", lease->macaddr, " ", macaddr, NULL);
+        if (mac != NULL) {
+            mac = str2mac(macaddr, mac);
+        }
+
+        table = DHCPRangeEnter(srvPtr);
+        lease = NULL;
+        if (ipaddr != NULL && *ipaddr) {
+            addr = inet_addr(ipaddr);
+            range = DHCPRangeFindFast(srvPtr, addr);
+            if (range != NULL) {
+                lease = DHCPLeaseFind(range, addr, mac, clientid, &buf);
+            }
+        } else
+        if (mac != NULL || clientid != NULL) {
+
+            /*
+             * Without an address resolve the client through the MAC/client-id
+             * index of each range, leases themselves are never scanned
+             */
+
+            for (i = 0; i < table->count && lease == NULL; i++) {
+                lease = DHCPLeaseFind(table->items[i], 0, mac, clientid, &buf);
             }
         }
+        if (lease != NULL) {
+            sprintf(macaddr, "%u %u", lease->lease_time, lease->expires);
+            Tcl_AppendResult(interp, addr2str(lease->ipaddr), " ", lease->macaddr, " ", macaddr, NULL);
+        }
+        DHCPRangeLeave(srvPtr);
         break;
+    }
 
     case cmdLeaseDel:
         if (objc < 3) {
@@ -914,29 +1635,29 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
 
     case cmdLeaseList:
         Ns_DStringInit(&ds);
-        Ns_MutexLock(&srvPtr->lock);
-        for (range = srvPtr->ranges; range; range = range->next) {
-             DHCPLeaseList(range, &ds);
+        table = DHCPRangeEnter(srvPtr);
+        for (i = 0; i < table->count; i++) {
+             DHCPLeaseList(table->items[i], &ds);
         }
-        Ns_MutexUnlock(&srvPtr->lock);
+        DHCPRangeLeave(srvPtr);
         Tcl_AppendResult(interp, ds.string, NULL);
         Ns_DStringFree(&ds);
         break;
 
     case cmdRangeList:
         Ns_DStringInit(&ds);
-        Ns_MutexLock(&srvPtr->lock);
-        for (range = srvPtr->ranges; range; range = range->next) {
-            DHCPRangeList(range, &ds);
+        table = DHCPRangeEnter(srvPtr);
+        for (i = 0; i < table->count; i++) {
+            DHCPRangeList(table->items[i], &ds);
         }
-        Ns_MutexUnlock(&srvPtr->lock);
+        DHCPRangeLeave(srvPtr);
         Tcl_AppendResult(interp, ds.string, NULL);
         Ns_DStringFree(&ds);
         break;
 
     case cmdRangeAdd: {
-        int j, argc;
-        CONST char **argv;
+        int j, storage = STORAGE_HASH, shards = 1;
+        struct in_addr addr, addr2;
         char *options[2] = { NULL, NULL };
         char *macaddr = NULL, *start, *end;
 
@@ -944,6 +1665,8 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
             {"-check",      Ns_ObjvString, &options[0],  NULL },
             {"-reply",      Ns_ObjvString, &options[1],  NULL },
             {"-macaddr",    Ns_ObjvString, &macaddr,     NULL },
+            {"-storage",    Ns_ObjvIndex,  &storage,     storages },
+            {"-shards",     Ns_ObjvInt,    &shards,      NULL },
             {"--",          Ns_ObjvBreak,  NULL,         NULL },
             {NULL, NULL, NULL, NULL}
         };
@@ -957,51 +1680,155 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
             Tcl_AppendResult(interp, "invalid arguments", NULL);
             return TCL_ERROR;
         }
-        range = (DHCPRange*)ns_calloc(1, sizeof(DHCPRange));
-        range->start = inet_addr(start);
-        range->end = inet_addr(end);
-        Tcl_InitHashTable(&range->leases, TCL_ONE_WORD_KEYS);
-        if (macaddr != NULL) {
-           str2mac(range->macaddr, macaddr);
+        if (!inet_aton(start, &addr)) {
+            Tcl_AppendResult(interp, "invalid address: ", start, NULL);
+            return TCL_ERROR;
+        }
+        if (!inet_aton(end, &addr2)) {
+            Tcl_AppendResult(interp, "invalid address: ", end, NULL);
+            return TCL_ERROR;
         }
+        range = (DHCPRange*)ns_calloc(1, sizeof(DHCPRange));
+        range->srvPtr = srvPtr;
+        range->start = ntohl(addr.s_addr);
+        range->end = ntohl(addr2.s_addr);
         if (range->end < range->start) {
             ns_free(range);
             Tcl_AppendResult(interp, "start less than end", NULL);
             return TCL_ERROR;
         }
-        for (j = 0; j < 2; j++) {
-            if (options[j] == NULL) {
-                continue;
+        // Number of addresses must fit into 32 bits
+        if (range->end - range->start == 0xFFFFFFFF) {
+            ns_free(range);
+            Tcl_AppendResult(interp, "range is too large", NULL);
+            return TCL_ERROR;
+        }
+        // Lease records are allocated for every address up front
+        if (storage == STORAGE_DENSE && range->end - range->start >= (u_int32_t)srvPtr->dense_max) {
+            ns_free(range);
+            Tcl_AppendResult(interp, "range is too large for dense storage", NULL);
+            return TCL_ERROR;
+        }
+        table = DHCPRangeEnter(srvPtr);
+        i = DHCPRangeSearch(table, range->end);
+        j = i >= 0 && table->items[i]->end >= range->start;
+        DHCPRangeLeave(srvPtr);
+        if (j) {
+            ns_free(range);
+            Tcl_AppendResult(interp, "range overlaps existing range", NULL);
+            return TCL_ERROR;
+        }
+        if (storage == STORAGE_DENSE) {
+            range->records = ns_calloc((size_t)(range->end - range->start) + 1, sizeof(DHCPLeaseRecord));
+        }
+        DHCPShardInit(range, shards);
+        DHCPIndexInit(range);
+        range->options = DHCPRangeOptionsCreate(interp, options[0], options[1], macaddr, NULL);
+        if (range->options == NULL) {
+            DHCPRangeFree(range);
+            return TCL_ERROR;
+        }
+        if (range) {
+            range->loading = 1;
+            if (srvPtr->snapshot.map.count > 0) {
+                DHCPSnapshotLoad(srvPtr, &srvPtr->snapshot.map, range);
+            }
+            if (srvPtr->journal.npending > 0) {
+                DHCPJournalLoad(srvPtr, range);
             }
-            if (Tcl_SplitList(interp, options[j], &argc, &argv) != TCL_OK) {
+            range->loading = 0;
+            if (DHCPRangeLink(srvPtr, range) != NS_OK) {
                 DHCPRangeFree(range);
-                Tcl_AppendResult(interp, "invalid list: ", options[j], NULL);
+                Tcl_AppendResult(interp, "range overlaps existing range", NULL);
                 return TCL_ERROR;
             }
-            for (i = 0; i < argc - 1; i += 2) {
-                opt = DHCPOptionCreate(argv[i], argv[i+1]);
-                if (opt == NULL) {
-                    DHCPRangeFree(range);
-                    Tcl_Free((char *) argv);
-                    Tcl_AppendResult(interp, "unknown option: ", argv[i], NULL);
-                    return TCL_ERROR;
-                }
-                if (j == 0) {
-                    opt->next = range->check;
-                    range->check = opt;
-                } else {
-                    opt->next = range->reply;
-                    range->reply = opt;
-                }
+            if (srvPtr->journal.npending > 0) {
+                DHCPJournalConsume(srvPtr, range);
             }
-            Tcl_Free((char *) argv);
         }
-        if (range) {
-            Ns_MutexLock(&srvPtr->lock);
-            range->next = srvPtr->ranges;
-            srvPtr->ranges = range;
-            Ns_MutexUnlock(&srvPtr->lock);
+        break;
+    }
+
+    case cmdRangeDel:
+        if (objc < 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "start");
+            return TCL_ERROR;
         }
+        if (DHCPRangeUnlink(srvPtr, ntohl(inet_addr(Tcl_GetString(objv[2])))) != NS_OK) {
+            Tcl_AppendResult(interp, "range not found", NULL);
+            return TCL_ERROR;
+        }
+        break;
+
+    case cmdRangeUpdate: {
+        char *options[2] = { NULL, NULL };
+        char *macaddr = NULL, *start;
+
+        Ns_ObjvSpec ruOpts[] = {
+            {"-check",      Ns_ObjvString, &options[0],  NULL },
+            {"-reply",      Ns_ObjvString, &options[1],  NULL },
+            {"-macaddr",    Ns_ObjvString, &macaddr,     NULL },
+            {"--",          Ns_ObjvBreak,  NULL,         NULL },
+            {NULL, NULL, NULL, NULL}
+        };
+        Ns_ObjvSpec ruArgs[] = {
+            {"start",   Ns_ObjvString, &start,   NULL },
+            {NULL, NULL, NULL, NULL}
+        };
+
+        if (Ns_ParseObjv(ruOpts, ruArgs, interp, 2, objc, objv) != NS_OK) {
+            Tcl_AppendResult(interp, "invalid arguments", NULL);
+            return TCL_ERROR;
+        }
+        if (DHCPRangeUpdate(srvPtr, interp, ntohl(inet_addr(start)), options[0], options[1], macaddr) != NS_OK) {
+            return TCL_ERROR;
+        }
+        break;
+    }
+
+    case cmdSlabStats:
+        Ns_DStringInit(&ds);
+        DHCPSlabStats(&ds);
+        Tcl_AppendResult(interp, ds.string, NULL);
+        Ns_DStringFree(&ds);
+        break;
+
+    case cmdTraceStats:
+        Ns_DStringInit(&ds);
+        DHCPTraceStats(srvPtr, &ds);
+        Tcl_AppendResult(interp, ds.string, NULL);
+        Ns_DStringFree(&ds);
+        break;
+
+    case cmdSnapshot: {
+        char *file;
+        DHCPSnapshot snap;
+        static CONST char *snapcmd[] = { "save", "load", NULL };
+
+        if (objc < 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "save|load ?path?");
+            return TCL_ERROR;
+        }
+        if (Tcl_GetIndexFromObj(interp, objv[2], snapcmd, "command", 0, &i) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        file = objc > 3 ? Tcl_GetString(objv[3]) : srvPtr->snapshot.path;
+        if (file == NULL) {
+            Tcl_AppendResult(interp, "no snapshot path configured", NULL);
+            return TCL_ERROR;
+        }
+        if (i == 0) {
+            status = DHCPSnapshotSave(srvPtr, file);
+        } else
+        if ((status = DHCPSnapshotOpen(file, &snap)) == NS_OK) {
+            status = DHCPSnapshotLoad(srvPtr, &snap, NULL);
+            DHCPSnapshotClose(&snap);
+        }
+        if (status < 0) {
+            Tcl_AppendResult(interp, "snapshot ", Tcl_GetString(objv[2]), " failed: ", file, NULL);
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(status));
         break;
     }
 
@@ -1020,9 +1847,38 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
         }
         break;
 
+    case cmdDictAdd: {
+        int code, subcode = 0, list = 0;
+        char *name, *type = "string";
+
+        Ns_ObjvSpec daOpts[] = {
+            {"-type",       Ns_ObjvString, &type,     NULL },
+            {"-list",       Ns_ObjvBool,   &list,     (void *) NS_TRUE },
+            {"--",          Ns_ObjvBreak,  NULL,      NULL },
+            {NULL, NULL, NULL, NULL}
+        };
+        Ns_ObjvSpec daArgs[] = {
+            {"name",        Ns_ObjvString, &name,     NULL },
+            {"code",        Ns_ObjvInt,    &code,     NULL },
+            {"?subcode",    Ns_ObjvInt,    &subcode,  NULL },
+            {NULL, NULL, NULL, NULL}
+        };
+
+        if (Ns_ParseObjv(daOpts, daArgs, interp, 2, objc, objv) != NS_OK) {
+            Tcl_AppendResult(interp, "invalid arguments", NULL);
+            return TCL_ERROR;
+        }
+        if (DHCPDictAdd(interp, name, code, subcode, type, list) != NS_OK) {
+            return TCL_ERROR;
+        }
+        break;
+    }
+
     case cmdDictList: {
         int j;
         Tcl_Obj *obj = Tcl_NewListObj(0, 0);
+
+        Ns_RWLockRdLock(&dictLock);
         for (i = 1; i < 255; i++) {
             Tcl_ListObjAppendElement(interp, obj, Tcl_NewStringObj(main_dict[i].name, -1));
             Tcl_ListObjAppendElement(interp, obj, Tcl_NewIntObj(main_dict[i].code));
@@ -1031,13 +1887,17 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
             if (main_dict[i].next) {
                dict = main_dict[i].next;
                for (j = 1; j < 255; j++) {
+                   if (dict[j].name == NULL) {
+                       continue;
+                   }
                    Tcl_ListObjAppendElement(interp, obj, Tcl_NewStringObj(dict[j].name, -1));
                    Tcl_ListObjAppendElement(interp, obj, Tcl_NewIntObj(dict[j].code));
                    Tcl_ListObjAppendElement(interp, obj, Tcl_NewIntObj(dict[j].subcode));
-                   Tcl_ListObjAppendElement(interp, obj, Tcl_NewStringObj(getTypeName(dict[i].flags), -1));
+                   Tcl_ListObjAppendElement(interp, obj, Tcl_NewStringObj(getTypeName(dict[j].flags), -1));
                }
             }
         }
+        Ns_RWLockUnlock(&dictLock);
         Tcl_SetObjResult(interp, obj);
         break;
     }
@@ -1048,11 +1908,23 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
             break;
         }
         if (objc < 3) {
-            Tcl_WrongNumArgs(interp, 2, objv, "name");
+            Tcl_WrongNumArgs(interp, 2, objv, "-all | -names list | name");
             return TCL_ERROR;
         }
-        Ns_DStringInit(&ds);
-        if (!strcmp(Tcl_GetString(objv[2]), "type")) {
+        if (!strcmp(Tcl_GetString(objv[2]), "-all")) {
+            Tcl_SetObjResult(interp, DHCPRequestDict(req, NULL));
+            break;
+        }
+        if (!strcmp(Tcl_GetString(objv[2]), "-names")) {
+            if (objc < 4) {
+                Tcl_WrongNumArgs(interp, 2, objv, "-names list");
+                return TCL_ERROR;
+            }
+            Tcl_SetObjResult(interp, DHCPRequestDict(req, objv[3]));
+            break;
+        }
+        Ns_DStringInit(&ds);
+        if (!strcmp(Tcl_GetString(objv[2]), "type")) {
             Ns_DStringPrintf(&ds, "%s", getMessageName(req->msgtype));
         } else
         if (!strcmp(Tcl_GetString(objv[2]), "xid")) {
@@ -1080,10 +1952,16 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
         } else
         if (!strcmp(Tcl_GetString(objv[2]), "lease_time")) {
            Ns_DStringPrintf(&ds, "%u", req->reply.lease_time);
+        } else
+        if (!strcmp(Tcl_GetString(objv[2]), "lease")) {
+            DHCPLease *lease = DHCPRequestLease(req);
+            if (lease != NULL) {
+                Ns_DStringPrintf(&ds, "%s %s %u %u", addr2str(lease->ipaddr), lease->macaddr, lease->lease_time, lease->expires);
+            }
         } else {
             u_int8_t *ptr;
             dict = getDict(Tcl_GetString(objv[2]));
-            if (dict != NULL && (ptr = getOption(&req->in, dict->code, dict->subcode, &option)) != NULL) {
+            if (dict != NULL && (ptr = DHCPRequestOption(req, dict->code, dict->subcode, &option)) != NULL) {
                 DHCPPrintValue(&ds, option.dict->name, option.dict->flags, option.size, ptr);
             }
         }
@@ -1096,44 +1974,23 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
         if (!req) {
             break;
         }
+        if (objc > 3 && !strcmp(Tcl_GetString(objv[2]), "-dict")) {
+            Tcl_DictSearch search;
+            Tcl_Obj *key, *value;
+            int done;
+
+            if (Tcl_DictObjFirst(interp, objv[3], &search, &key, &value, &done) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            for (status = TCL_OK; !done && status == TCL_OK; Tcl_DictObjNext(&search, &key, &value, &done)) {
+                status = DHCPRequestSet(interp, req, Tcl_GetString(key), Tcl_GetString(value));
+            }
+            Tcl_DictObjDone(&search);
+            return status;
+        }
         for (i = 2; i < objc - 1; i += 2) {
-            if (!strcasecmp(Tcl_GetString(objv[i]), "type")) {
-                req->reply.msgtype = getMessageID(Tcl_GetString(objv[i+1]));
-            } else
-            if (!strcmp(Tcl_GetString(objv[i]), "yiaddr")) {
-                req->in.yiaddr = inet_addr(Tcl_GetString(objv[i+1]));
-            } else
-            if (!strcmp(Tcl_GetString(objv[i]), "siaddr")) {
-                req->in.siaddr = inet_addr(Tcl_GetString(objv[i+1]));
-            } else
-            if (!strcmp(Tcl_GetString(objv[i]), "giaddr")) {
-                req->in.giaddr = inet_addr(Tcl_GetString(objv[i+1]));
-            } else
-            if (!strcmp(Tcl_GetString(objv[i]), "ciaddr")) {
-                req->in.ciaddr = inet_addr(Tcl_GetString(objv[i+1]));
-            } else
-            if (!strcmp(Tcl_GetString(objv[i]), "network")) {
-                req->reply.netmask = inet_addr(Tcl_GetString(objv[i+1]));
-            } else
-            if (!strcmp(Tcl_GetString(objv[i]), "broadcast")) {
-                req->reply.broadcast = inet_addr(Tcl_GetString(objv[i+1]));
-            } else
-            if (!strcmp(Tcl_GetString(objv[i]), "gateway")) {
-                req->reply.gateway = inet_addr(Tcl_GetString(objv[i+1]));
-            } else
-            if (!strcmp(Tcl_GetString(objv[i]), "nameserver")) {
-                req->reply.nameserver = inet_addr(Tcl_GetString(objv[i+1]));
-            } else
-            if (!strcmp(Tcl_GetString(objv[i]), "lease_time")) {
-                req->reply.lease_time = atol(Tcl_GetString(objv[i+1]));
-            } else {
-                opt = DHCPOptionCreate(Tcl_GetString(objv[i]), Tcl_GetString(objv[i+1]));
-                if (opt == NULL) {
-                    Tcl_AppendResult(interp, "unknown option: ", Tcl_GetString(objv[i]), NULL);
-                    return TCL_ERROR;
-                }
-                opt->next = req->reply.options;
-                req->reply.options = opt;
+            if (DHCPRequestSet(interp, req, Tcl_GetString(objv[i]), Tcl_GetString(objv[i+1])) != TCL_OK) {
+                return TCL_ERROR;
             }
         }
         break;
@@ -1179,24 +2036,157 @@ static int DHCPCmd(ClientData arg, Tcl_Interp * interp, int objc, Tcl_Obj * CONS
 static bool DHCPSockProc(NS_SOCKET sock, void *arg, unsigned int why)
 {
     DHCPServer *srvPtr = (DHCPServer*)arg;
-    struct sockaddr_in sa;
-    DHCPRequest *req;
-    char buffer[2048];
-    int size;
 
     if (why != NS_SOCK_READ) {
         (void) ns_sockclose(sock);
         return NS_FALSE;
     }
-    size = DHCPRequestRead(srvPtr, sock, buffer, sizeof(buffer), &sa);
-    req = DHCPRequestCreate(srvPtr, sock, buffer, size, &sa);
-    if (req != NULL) {
+    DHCPSockRead(srvPtr, sock, srvPtr->batch.ptr);
+    return NS_TRUE;
+}
+
+/* Receive and process one datagram or one batch of them */
+static void DHCPSockRead(DHCPServer *srvPtr, NS_SOCKET sock, DHCPBatch *batch)
+{
+    struct sockaddr_in sa;
+    DHCPRequest *req;
+    int size;
+
+    if (batch != NULL) {
+        DHCPBatchProcess(batch);
+        return;
+    }
+    req = DHCPRequestThread();
+    size = DHCPRequestRead(srvPtr, sock, (char*)&req->in, sizeof(req->in) + sizeof(req->overflow), &sa);
+    if (DHCPRequestInit(req, srvPtr, sock, size, &sa) != NULL) {
         DHCPRequestProcess(req);
         DHCPRequestFree(req);
     }
-    return NS_TRUE;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPListenInit --
+ *
+ *	Open SO_REUSEPORT sockets on the DHCP port, one per configured
+ *      thread, the kernel spreads clients between them
+ *
+ * Results:
+ *	NS_OK or NS_ERROR if no socket could be opened
+ *
+ * Side effects:
+ *  	Listener threads are started
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPListenInit(DHCPServer *srvPtr)
+{
+    int i;
+    DHCPListener *lsPtr;
+
+    srvPtr->listen.list = ns_calloc(srvPtr->listen.threads, sizeof(DHCPListener));
+    for (i = 0; i < srvPtr->listen.threads; i++) {
+        lsPtr = &srvPtr->listen.list[i];
+        lsPtr->srvPtr = srvPtr;
+        lsPtr->id = i;
+        lsPtr->sock = Ns_SockListenUdp(srvPtr->address, srvPtr->port, NS_TRUE);
+        if (lsPtr->sock == -1) {
+            Ns_Log(Error, "nsdhcpd: couldn't create socket %d: %s:%d: %s", i, srvPtr->address, srvPtr->port, strerror(errno));
+            while (--i >= 0) {
+                ns_sockclose(srvPtr->listen.list[i].sock);
+            }
+            ns_free(srvPtr->listen.list);
+            srvPtr->listen.list = NULL;
+            return NS_ERROR;
+        }
+        if (srvPtr->batch.size > 1) {
+            lsPtr->batch = DHCPBatchCreate(srvPtr, lsPtr->sock, srvPtr->batch.size, srvPtr->batch.flush);
+        }
+    }
+    srvPtr->sock = srvPtr->listen.list[0].sock;
+    srvPtr->listen.running = srvPtr->listen.threads;
+    for (i = 0; i < srvPtr->listen.threads; i++) {
+        Ns_ThreadCreate(DHCPListenThread, &srvPtr->listen.list[i], 0, NULL);
+    }
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPListenThread --
+ *
+ *	Serves one SO_REUSEPORT socket, optionally bound to one cpu
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPListenThread(void *arg)
+{
+    DHCPListener *lsPtr = (DHCPListener*)arg;
+    DHCPServer *srvPtr = lsPtr->srvPtr;
+    struct pollfd pfd;
+
+    Ns_ThreadSetName("-nsdhcpd:listen%d-", lsPtr->id);
+
+#ifdef __linux__
+    if (srvPtr->listen.pin) {
+        cpu_set_t set;
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        CPU_ZERO(&set);
+        CPU_SET(lsPtr->id % (ncpus > 0 ? ncpus : 1), &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            Ns_Log(Warning, "nsdhcpd: listener %d: cannot set cpu affinity: %s", lsPtr->id, strerror(errno));
+        }
+    }
+#endif
+    Ns_Log(Notice, "nsdhcpd: listener %d started on socket %d", lsPtr->id, lsPtr->sock);
+
+    pfd.fd = lsPtr->sock;
+    pfd.events = POLLIN;
+    while (!srvPtr->listen.shutdown) {
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 1000) <= 0 || !(pfd.revents & POLLIN)) {
+            continue;
+        }
+        DHCPSockRead(srvPtr, lsPtr->sock, lsPtr->batch);
+    }
+    ns_sockclose(lsPtr->sock);
+
+    Ns_MutexLock(&srvPtr->listen.lock);
+    srvPtr->listen.running--;
+    Ns_CondBroadcast(&srvPtr->listen.cond);
+    Ns_MutexUnlock(&srvPtr->listen.lock);
+    Ns_Log(Notice, "nsdhcpd: listener %d stopped", lsPtr->id);
+}
+
+static void DHCPListenShutdown(const Ns_Time *toPtr, void *arg)
+{
+    DHCPServer *srvPtr = (DHCPServer*)arg;
+
+    Ns_MutexLock(&srvPtr->listen.lock);
+    if (toPtr == NULL) {
+        srvPtr->listen.shutdown = 1;
+    } else {
+        while (srvPtr->listen.running > 0) {
+            if (Ns_CondTimedWait(&srvPtr->listen.cond, &srvPtr->listen.lock, toPtr) != NS_OK) {
+                break;
+            }
+        }
+    }
+    Ns_MutexUnlock(&srvPtr->listen.lock);
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1228,6 +2218,18 @@ static int DHCPDriverProc(Ns_DriverCmd cmd, Ns_Sock *sock, struct iovec *bufs, i
          break;
 
      case DriverRecv:
+
+         /*
+          *  Packets go straight to the worker pool, nothing is left for
+          *  the connection threads. Zero bytes tells the driver there is
+          *  nothing to queue, NS_ERROR would be counted as a read error
+          *  for every packet handed to the workers
+          */
+
+         if (srvPtr->workers.threads > 0) {
+             DHCPWorkerRecv(srvPtr, sock->sock);
+             return 0;
+         }
          return DHCPRequestRead(srvPtr, sock->sock, bufs->iov_base, bufs->iov_len, &sock->sa);
          break;
 
@@ -1239,6 +2241,153 @@ static int DHCPDriverProc(Ns_DriverCmd cmd, Ns_Sock *sock, struct iovec *bufs, i
     return NS_ERROR;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPWorkerInit --
+ *
+ *	Allocate requests of the driver mode worker pool and start workers
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Worker threads are started
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPWorkerInit(DHCPServer *srvPtr)
+{
+    int i;
+    DHCPRequest *req;
+
+    for (i = 0; i < srvPtr->workers.size; i++) {
+        req = ns_calloc(1, sizeof(DHCPRequest));
+        req->cached = 1;
+        req->nextPtr = srvPtr->workers.free;
+        srvPtr->workers.free = req;
+    }
+    srvPtr->workers.running = srvPtr->workers.threads;
+    for (i = 0; i < srvPtr->workers.threads; i++) {
+        Ns_ThreadCreate(DHCPWorkerThread, srvPtr, 0, NULL);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPWorkerRecv --
+ *
+ *	Called by the driver thread, receives datagram into a free request
+ *      and queues it for the workers. When all requests are queued the
+ *      packet is read and dropped so the socket does not stay readable.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Worker is woken up
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPWorkerRecv(DHCPServer *srvPtr, NS_SOCKET sock)
+{
+    DHCPRequest *req;
+    u_int64_t dropped = 0;
+
+    Ns_MutexLock(&srvPtr->workers.lock);
+    req = srvPtr->workers.free;
+    if (req != NULL) {
+        srvPtr->workers.free = req->nextPtr;
+    } else {
+        dropped = ++srvPtr->workers.dropped;
+    }
+    Ns_MutexUnlock(&srvPtr->workers.lock);
+
+    if (req == NULL) {
+        struct sockaddr_in sa;
+        char buffer[sizeof(DHCPPacket) + 2];
+
+        DHCPRequestRead(srvPtr, sock, buffer, sizeof(buffer), &sa);
+        if (dropped % 1000 == 1) {
+            Ns_Log(Warning, "nsdhcpd: worker queue is full, %llu packets dropped", (unsigned long long)dropped);
+        }
+        return;
+    }
+    req->sock = sock;
+    req->size = DHCPRequestRead(srvPtr, sock, (char*)&req->in, sizeof(req->in) + sizeof(req->overflow), &req->sa);
+    req->nextPtr = NULL;
+
+    Ns_MutexLock(&srvPtr->workers.lock);
+    if (req->size <= 0) {
+        req->nextPtr = srvPtr->workers.free;
+        srvPtr->workers.free = req;
+    } else {
+        if (srvPtr->workers.tail != NULL) {
+            srvPtr->workers.tail->nextPtr = req;
+        } else {
+            srvPtr->workers.head = req;
+        }
+        srvPtr->workers.tail = req;
+        Ns_CondSignal(&srvPtr->workers.cond);
+    }
+    Ns_MutexUnlock(&srvPtr->workers.lock);
+}
+
+static void DHCPWorkerThread(void *arg)
+{
+    DHCPServer *srvPtr = (DHCPServer*)arg;
+    DHCPRequest *req;
+
+    Ns_ThreadSetName("-nsdhcpd:worker-");
+
+    Ns_MutexLock(&srvPtr->workers.lock);
+    while (!srvPtr->workers.shutdown) {
+        if (srvPtr->workers.head == NULL) {
+            Ns_CondWait(&srvPtr->workers.cond, &srvPtr->workers.lock);
+            continue;
+        }
+        req = srvPtr->workers.head;
+        srvPtr->workers.head = req->nextPtr;
+        if (srvPtr->workers.head == NULL) {
+            srvPtr->workers.tail = NULL;
+        }
+        Ns_MutexUnlock(&srvPtr->workers.lock);
+
+        if (DHCPRequestInit(req, srvPtr, req->sock, req->size, &req->sa) != NULL) {
+            DHCPRequestProcess(req);
+            DHCPRequestFree(req);
+        }
+
+        Ns_MutexLock(&srvPtr->workers.lock);
+        req->nextPtr = srvPtr->workers.free;
+        srvPtr->workers.free = req;
+    }
+    srvPtr->workers.running--;
+    Ns_CondBroadcast(&srvPtr->workers.cond);
+    Ns_MutexUnlock(&srvPtr->workers.lock);
+}
+
+static void DHCPWorkerShutdown(const Ns_Time *toPtr, void *arg)
+{
+    DHCPServer *srvPtr = (DHCPServer*)arg;
+
+    Ns_MutexLock(&srvPtr->workers.lock);
+    if (toPtr == NULL) {
+        srvPtr->workers.shutdown = 1;
+        Ns_CondBroadcast(&srvPtr->workers.cond);
+    } else {
+        while (srvPtr->workers.running > 0) {
+            if (Ns_CondTimedWait(&srvPtr->workers.cond, &srvPtr->workers.lock, toPtr) != NS_OK) {
+                break;
+            }
+        }
+    }
+    Ns_MutexUnlock(&srvPtr->workers.lock);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1267,8 +2416,9 @@ static int DHCPRequestProc(void *arg, Ns_Conn *conn)
     sockPtr = Ns_ConnSockPtr(conn);
     sa = sockPtr->sa;
 
-    req = DHCPRequestCreate(srvPtr, sockPtr->sock, ds->string, ds->length, &sa);
-    if (req != NULL) {
+    req = DHCPRequestThread();
+    memcpy(&req->in, ds->string, ds->length > sizeof(req->in) ? sizeof(req->in) + 1 : ds->length);
+    if (DHCPRequestInit(req, srvPtr, sockPtr->sock, ds->length, &sa) != NULL) {
         DHCPRequestProcess(req);
         DHCPRequestFree(req);
     }
@@ -1280,10 +2430,11 @@ static int DHCPRequestProc(void *arg, Ns_Conn *conn)
  *
  * DHCPRequestCreate --
  *
- *	Create request structure
+ *	Create request structure from the packet in the given buffer,
+ *      used outside of the receive path, i.e. by ns_dhcpd send
  *
  * Results:
- *	NS_TRUE
+ *	Request or NULL if the packet is invalid
  *
  * Side effects:
  *  	None
@@ -1293,53 +2444,36 @@ static int DHCPRequestProc(void *arg, Ns_Conn *conn)
 
 static DHCPRequest *DHCPRequestCreate(DHCPServer *srvPtr, NS_SOCKET sock, char *buffer, int size, struct sockaddr_in *sa)
 {
-    u_int8_t *type;
-    DHCPRequest *req = NULL;
+    DHCPRequest *req;
 
-    if (buffer != NULL && size > 0) {
-        req = (DHCPRequest*)buffer;
-        if (size > sizeof(DHCPPacket)) {
-	    Ns_Log(Debug, "nsdhcpd: packet received is too big %d > %d", size, sizeof(DHCPPacket));
-	    return NULL;
-	}
-	if (ntohl(req->in.cookie) != DHCP_MAGIC) {
-	    Ns_Log(Debug, "nsdhcpd: client sent bogus req %x, should be %x", req->in.cookie, DHCP_MAGIC);
-	    return NULL;
-	}
-
-	if (req->in.hlen != 6 && req->in.hlen != 0) {
-	    Ns_Log(Debug, "nsdhcpd: MAC length is %d bytes", req->in.hlen);
-	    return NULL;
-	}
-        req = ns_calloc(1, sizeof(DHCPRequest));
-        memcpy(&req->in, buffer, size);
-        bin2hex(req->macaddr, req->in.macaddr, 6);
-        req->sock = dup(sock);
-        req->srvPtr = srvPtr;
-        req->buffer = buffer;
-        req->size = size;
-        req->sa = *sa;
-        req->parser.ptr = req->out.options;
-        req->parser.end = req->out.options;
-        req->parser.end += OPTION_SIZE;
-        type = getOption(&req->in, DHCP_MESSAGE_TYPE, 0, 0);
-        if (type != NULL) {
-            req->msgtype = *type;
-        }
-        return req;
+    if (buffer == NULL || size <= 0) {
+        return NULL;
     }
-    return NULL;
+    if (size > sizeof(DHCPPacket)) {
+        Ns_Log(Debug, "nsdhcpd: packet received is too big %d > %d", size, sizeof(DHCPPacket));
+        return NULL;
+    }
+    req = (DHCPRequest*)DHCPSlabAlloc(SLAB_REQUEST);
+    memcpy(&req->in, buffer, size);
+    if (DHCPRequestInit(req, srvPtr, sock, size, sa) == NULL) {
+        DHCPRequestFree(req);
+        return NULL;
+    }
+    return req;
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * DHCPRequestRead --
+ * DHCPRequestInit --
  *
- *	Read DHCP data from the socket
+ *	Validate the packet received into req->in and prepare the request
+ *      for processing. Requests are reused, so only the fields the reply
+ *      builder depends on are reset, options of the reply are written
+ *      sequentially and sent up to the parser position.
  *
  * Results:
- *	NS_TRUE
+ *	Request or NULL if the packet is invalid
  *
  * Side effects:
  *  	None
@@ -1347,34 +2481,91 @@ static DHCPRequest *DHCPRequestCreate(DHCPServer *srvPtr, NS_SOCKET sock, char *
  *----------------------------------------------------------------------
  */
 
-static int DHCPRequestRead(DHCPServer *srvPtr, NS_SOCKET sock, char *buffer, int size, struct sockaddr_in *sa)
+static DHCPRequest *DHCPRequestInit(DHCPRequest *req, DHCPServer *srvPtr, NS_SOCKET sock, int size, struct sockaddr_in *sa)
 {
-    int len;
-    socklen_t salen = sizeof(struct sockaddr_in);
+    u_int8_t *type;
+    DHCPOption clientid;
 
-    len = recvfrom(sock, buffer, size - 1, 0, (struct sockaddr*)sa, (socklen_t*)&salen);
-    if (len <= 0) {
-        if (errno) {
-            Ns_Log(Debug, "DHCPRequestRead: %d: recv error: %d bytes, %s", sock, len, strerror(errno));
-        }
-        return NS_ERROR;
+    if (req == NULL || size <= 0) {
+        return NULL;
     }
-    buffer[len] = 0;
-    if (srvPtr->debug > 2) {
-        Ns_Log(Debug, "nsdhcpd: received %d bytes from %s:%d", len, ns_inet_ntoa(sa->sin_addr), ntohs(sa->sin_port));
+    if (size > sizeof(DHCPPacket)) {
+        Ns_Log(Debug, "nsdhcpd: packet received is too big %d > %d", size, sizeof(DHCPPacket));
+        return NULL;
     }
-    return len;
+    if (size < offsetof(DHCPPacket, options)) {
+        Ns_Log(Debug, "nsdhcpd: packet received is too small %d", size);
+        return NULL;
+    }
+    if (ntohl(req->in.cookie) != DHCP_MAGIC) {
+        Ns_Log(Debug, "nsdhcpd: client sent bogus req %x, should be %x", req->in.cookie, DHCP_MAGIC);
+        return NULL;
+    }
+    if (req->in.hlen != 6 && req->in.hlen != 0) {
+        Ns_Log(Debug, "nsdhcpd: MAC length is %d bytes", req->in.hlen);
+        return NULL;
+    }
+
+    /* Remains of a previous packet must not be seen as options */
+    memset((u_int8_t*)&req->in + size, 0, sizeof(DHCPPacket) - size);
+    memset(&req->out, 0, offsetof(DHCPPacket, options));
+    memset(&req->reply, 0, sizeof(req->reply));
+
+    bin2str(req->macaddr, req->in.macaddr, 6);
+    req->clientid[0] = 0;
+    req->msgtype = 0;
+    req->range = NULL;
+    req->leased = 0;
+    req->batch = NULL;
+    req->queued = 0;
+    req->sock = sock;
+    req->srvPtr = srvPtr;
+    req->size = size;
+    req->sa = *sa;
+    req->parser.ptr = req->out.options;
+    req->parser.end = req->out.options;
+    req->parser.end += OPTION_SIZE;
+    DHCPRequestIndex(req);
+    type = DHCPRequestOption(req, DHCP_MESSAGE_TYPE, 0, 0);
+    if (type != NULL) {
+        req->msgtype = *type;
+    }
+    if (DHCPRequestOption(req, DHCP_CLIENT_IDENTIFIER, 0, &clientid) != NULL && clientid.size > 0) {
+        bin2str(req->clientid, clientid.ptr, clientid.size);
+    }
+    return req;
+}
+
+/* Returns request object of the current thread, packets are received straight into it */
+static DHCPRequest *DHCPRequestThread(void)
+{
+    DHCPRequest *req = Ns_TlsGet(&reqCacheTls);
+
+    if (req == NULL) {
+        req = ns_calloc(1, sizeof(DHCPRequest));
+        req->cached = 1;
+        Ns_TlsSet(&reqCacheTls, req);
+    }
+    return req;
+}
+
+static void DHCPRequestCleanup(void *arg)
+{
+    DHCPRequest *req = (DHCPRequest*)arg;
+
+    DHCPOptionFree(req->reply.options);
+    ns_free(req);
 }
 
 /*
  *----------------------------------------------------------------------
  *
- * DHCPRequestProcess --
+ * DHCPBatchCreate --
  *
- *	Perform actual DHCP processing
+ *	Allocate receive areas and message headers for batched socket I/O
  *
  * Results:
- *	NS_TRUE
+ *	Batch structure
  *
  * Side effects:
  *  	None
@@ -1382,41 +2573,272 @@ static int DHCPRequestRead(DHCPServer *srvPtr, NS_SOCKET sock, char *buffer, int
  *----------------------------------------------------------------------
  */
 
-static int DHCPRequestProcess(DHCPRequest *req)
+static DHCPBatch *DHCPBatchCreate(DHCPServer *srvPtr, NS_SOCKET sock, int size, int flush)
 {
-    Tcl_Interp *interp = NULL;
-    int msgtype = req->msgtype;
-
-    if (req->srvPtr->debug > 3) {
-        Ns_DString ds;
-        Ns_DStringInit(&ds);
-        DHCPPrintRequest(&ds, req, 0);
-        Ns_Log(Debug, "nsdhcpd: request %d bytes from %s:%d: %s", req->size,
-               ns_inet_ntoa(req->sa.sin_addr), ntohs(req->sa.sin_port), ds.string);
-        Ns_DStringFree(&ds);
+    int i;
+    DHCPBatch *batch = ns_calloc(1, sizeof(DHCPBatch));
+
+    batch->srvPtr = srvPtr;
+    batch->sock = sock;
+    batch->size = size;
+    batch->flush = flush;
+    batch->reqs = ns_calloc(size, sizeof(DHCPRequest*));
+    batch->lengths = ns_calloc(size, sizeof(int));
+    batch->from = ns_calloc(size, sizeof(struct sockaddr_in));
+    batch->to = ns_calloc(size, sizeof(struct sockaddr_in));
+    batch->iov = ns_calloc(size, sizeof(struct iovec));
+#ifdef __linux__
+    batch->rmsgs = ns_calloc(size, sizeof(struct mmsghdr));
+    batch->riov = ns_calloc(size, sizeof(struct iovec));
+    batch->smsgs = ns_calloc(size, sizeof(struct mmsghdr));
+#endif
+    for (i = 0; i < size; i++) {
+        batch->reqs[i] = ns_calloc(1, sizeof(DHCPRequest));
+        batch->reqs[i]->cached = 1;
+#ifdef __linux__
+        batch->riov[i].iov_base = &batch->reqs[i]->in;
+        batch->riov[i].iov_len = sizeof(DHCPPacket) + 1;
+        batch->rmsgs[i].msg_hdr.msg_iov = &batch->riov[i];
+        batch->rmsgs[i].msg_hdr.msg_iovlen = 1;
+        batch->rmsgs[i].msg_hdr.msg_name = &batch->from[i];
+        batch->smsgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        batch->smsgs[i].msg_hdr.msg_iovlen = 1;
+        batch->smsgs[i].msg_hdr.msg_name = &batch->to[i];
+        batch->smsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+#endif
     }
+    return batch;
+}
 
-    Ns_TlsSet(&reqTls, req);
-
-    if (req->srvPtr->run_proc != NULL) {
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPBatchProcess --
+ *
+ *	Drain up to batch size datagrams from the socket, process them and
+ *      send all queued replies at once. Anything left in the socket is
+ *      picked up by the next wakeup, so a burst of requests cannot hold
+ *      the socket callback thread indefinitely.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Replies are sent
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPBatchProcess(DHCPBatch *batch)
+{
+    int i, count;
+    DHCPRequest *req;
+
+    count = DHCPBatchRecv(batch);
+    for (i = 0; i < count; i++) {
+        req = DHCPRequestInit(batch->reqs[i], batch->srvPtr, batch->sock, batch->lengths[i], &batch->from[i]);
+        if (req != NULL) {
+            req->batch = batch;
+            DHCPRequestProcess(req);
+            DHCPRequestFree(req);
+        }
+    }
+    DHCPBatchFlush(batch);
+}
+
+/* Receive datagrams without blocking, returns number of received packets */
+static int DHCPBatchRecv(DHCPBatch *batch)
+{
+    int i, count = 0;
+
+#ifdef __linux__
+    for (i = 0; i < batch->size; i++) {
+        batch->rmsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    count = recvmmsg(batch->sock, batch->rmsgs, batch->size, MSG_DONTWAIT, NULL);
+    if (count < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            Ns_Log(Debug, "DHCPBatchRecv: %d: recv error: %s", batch->sock, strerror(errno));
+        }
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        batch->lengths[i] = batch->rmsgs[i].msg_len;
+    }
+#else
+    socklen_t salen;
+
+    for (count = 0; count < batch->size; count++) {
+        salen = sizeof(struct sockaddr_in);
+        i = recvfrom(batch->sock, (char*)&batch->reqs[count]->in, sizeof(DHCPPacket) + 1, MSG_DONTWAIT,
+                     (struct sockaddr*)&batch->from[count], &salen);
+        if (i <= 0) {
+            break;
+        }
+        batch->lengths[count] = i;
+    }
+#endif
+    if (batch->srvPtr->debug > 2) {
+        Ns_Log(Debug, "nsdhcpd: received %d packets in batch", count);
+    }
+    return count;
+}
+
+/* Remember reply to be sent by the next flush */
+static void DHCPBatchQueue(DHCPBatch *batch, DHCPRequest *req, struct sockaddr_in *sa, int size)
+{
+    if (req->queued || batch->nqueued >= batch->size) {
+        DHCPBatchFlush(batch);
+    }
+    batch->to[batch->nqueued] = *sa;
+    batch->iov[batch->nqueued].iov_base = &req->out;
+    batch->iov[batch->nqueued].iov_len = size;
+    batch->nqueued++;
+    req->queued = 1;
+    if (batch->nqueued >= batch->flush) {
+        DHCPBatchFlush(batch);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPBatchFlush --
+ *
+ *	Send all queued replies
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Queue is emptied
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPBatchFlush(DHCPBatch *batch)
+{
+    int i, sent = 0, rc;
+
+#ifdef __linux__
+    while (sent < batch->nqueued) {
+        rc = sendmmsg(batch->sock, batch->smsgs + sent, batch->nqueued - sent, 0);
+        if (rc <= 0) {
+            Ns_Log(Debug, "DHCPBatchFlush: %d: send error: %s", batch->sock, strerror(errno));
+            break;
+        }
+        sent += rc;
+    }
+#else
+    for (; sent < batch->nqueued; sent++) {
+        rc = sendto(batch->sock, batch->iov[sent].iov_base, batch->iov[sent].iov_len, 0,
+                    (struct sockaddr*)&batch->to[sent], sizeof(struct sockaddr_in));
+        if (rc < 0) {
+            Ns_Log(Debug, "DHCPBatchFlush: %d: send error: %s", batch->sock, strerror(errno));
+        }
+    }
+#endif
+    for (i = 0; i < batch->size; i++) {
+        batch->reqs[i]->queued = 0;
+    }
+    batch->nqueued = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRequestRead --
+ *
+ *	Read DHCP data from the socket
+ *
+ * Results:
+ *	NS_TRUE
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPRequestRead(DHCPServer *srvPtr, NS_SOCKET sock, char *buffer, int size, struct sockaddr_in *sa)
+{
+    int len;
+    socklen_t salen = sizeof(struct sockaddr_in);
+
+    len = recvfrom(sock, buffer, size - 1, 0, (struct sockaddr*)sa, (socklen_t*)&salen);
+    if (len <= 0) {
+        if (errno) {
+            Ns_Log(Debug, "DHCPRequestRead: %d: recv error: %d bytes, %s", sock, len, strerror(errno));
+        }
+        return NS_ERROR;
+    }
+    buffer[len] = 0;
+    if (srvPtr->debug > 2) {
+        Ns_Log(Debug, "nsdhcpd: received %d bytes from %s:%d", len, ns_inet_ntoa(sa->sin_addr), ntohs(sa->sin_port));
+    }
+    return len;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRequestProcess --
+ *
+ *	Perform actual DHCP processing
+ *
+ * Results:
+ *	NS_TRUE
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPRequestProcess(DHCPRequest *req)
+{
+    Tcl_Interp *interp = NULL;
+    DHCPScripts *scripts = NULL;
+    int msgtype = req->msgtype;
+    int type = msgtype <= DHCP_INFORM ? msgtype : 0;
+
+    if (req->srvPtr->debug > 3) {
+        Ns_DString ds;
+        Ns_DStringInit(&ds);
+        DHCPPrintRequest(&ds, req, 0);
+        Ns_Log(Debug, "nsdhcpd: request %d bytes from %s:%d: %s", req->size,
+               ns_inet_ntoa(req->sa.sin_addr), ntohs(req->sa.sin_port), ds.string);
+        Ns_DStringFree(&ds);
+    }
+
+    Ns_TlsSet(&reqTls, req);
+    DHCPRangeEnter(req->srvPtr);
+
+    if (req->srvPtr->plugins.count > 0) {
+        DHCPPluginRequest(req);
+    }
+
+    /* Interp is allocated only when the script of this message type will run */
+    if (req->srvPtr->procs[type] != NULL && req->reply.msgtype == 0 && DHCPFilterMatch(req)) {
         interp = Ns_TclAllocateInterp(req->srvPtr->name);
-        if (Tcl_EvalEx(interp, req->srvPtr->run_proc, -1, 0) != TCL_OK) {
+        scripts = DHCPScriptsGet(req->srvPtr, interp);
+        if (Tcl_EvalObjEx(interp, scripts->run[type], 0) != TCL_OK) {
             Ns_TclLogError(interp);
         }
+    }
 
-        /* Script set reply code, we assume we are ready to return reply packet */
-        switch (req->reply.msgtype) {
-         case DHCP_ACK:
-         case DHCP_OFFER:
-             DHCPSend(req, DHCP_ACK);
-             msgtype = req->reply.msgtype;
-             break;
+    /* Plugin or script set reply code, we assume we are ready to return reply packet */
+    switch (req->reply.msgtype) {
+     case DHCP_ACK:
+     case DHCP_OFFER:
+         DHCPSend(req, DHCP_ACK);
+         msgtype = req->reply.msgtype;
+         break;
 
-         case DHCP_NAK:
-             DHCPSendNAK(req);
-             msgtype = req->reply.msgtype;
-             break;
-        }
+     case DHCP_NAK:
+         DHCPSendNAK(req);
+         msgtype = req->reply.msgtype;
+         break;
     }
 
     switch (msgtype) {
@@ -1445,12 +2867,20 @@ static int DHCPRequestProcess(DHCPRequest *req)
     	Ns_Log(Debug, "nsdhcpd: unsupported msg type (%d) %s", req->msgtype, req->macaddr);
     }
 
+    if (req->srvPtr->plugins.count > 0) {
+        DHCPPluginReply(req);
+    }
+
     // Postprocessing script
+    if (req->srvPtr->trace_proc != NULL && req->srvPtr->trace.threads > 0) {
+        DHCPTraceQueue(req);
+    } else
     if (req->srvPtr->trace_proc != NULL) {
         if (interp == NULL) {
             interp = Ns_TclAllocateInterp(req->srvPtr->name);
+            scripts = DHCPScriptsGet(req->srvPtr, interp);
         }
-        if (Tcl_EvalEx(interp, req->srvPtr->trace_proc, -1, 0) != TCL_OK) {
+        if (Tcl_EvalObjEx(interp, scripts->trace, 0) != TCL_OK) {
             Ns_TclLogError(interp);
         }
     }
@@ -1458,668 +2888,4258 @@ static int DHCPRequestProcess(DHCPRequest *req)
     if (interp != NULL) {
         Ns_TclDeAllocateInterp(interp);
     }
+    DHCPRangeLeave(req->srvPtr);
     Ns_TlsSet(&reqTls, 0);
     return NS_TRUE;
 }
 
-static void DHCPRequestFree(DHCPRequest *req)
-{
-    ns_free(req);
-}
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPPluginInit --
+ *
+ *	Load native policy plugins listed in the plugins parameter, every
+ *      library exports Ns_DhcpPluginInit which fills the hooks
+ *
+ * Results:
+ *	NS_OK or NS_ERROR if any plugin cannot be loaded
+ *
+ * Side effects:
+ *  	Libraries are loaded and stay loaded
+ *
+ *----------------------------------------------------------------------
+ */
 
-static int DHCPRequestSend(DHCPRequest *req, u_int32_t ipaddr, int port)
+static int DHCPPluginInit(DHCPServer *srvPtr, const char *server, const char *module, char *list)
 {
-    int len;
-    u_int8_t *ptr;
-    struct sockaddr_in sa;
+    int i, argc;
+    CONST char **argv;
+    Ns_DhcpPlugin *plugin;
+    Ns_DhcpPluginInitProc *initProc;
 
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_addr.s_addr = ipaddr;
-    sa.sin_port = htons(port);
-    len = sizeof(DHCPPacket);
-    ptr = (u_int8_t *) &req->out;
-    while (*(ptr + len - 1) == 0 && *(ptr + len - 2) == 0 && *(ptr + len - 3) == 0) {
-          len--;
+    if (list == NULL) {
+        return NS_OK;
     }
-    return sendto(req->sock, (char *) &req->out, len, 0, (struct sockaddr *) &sa, sizeof(sa));
+    if (Tcl_SplitList(NULL, list, &argc, &argv) != TCL_OK) {
+        Ns_Log(Error, "%s: invalid plugins list: %s", module, list);
+        return NS_ERROR;
+    }
+    srvPtr->plugins.list = ns_calloc(argc + 1, sizeof(Ns_DhcpPlugin));
+    for (i = 0; i < argc; i++) {
+        initProc = (Ns_DhcpPluginInitProc*)Ns_ModuleSymbol(argv[i], "Ns_DhcpPluginInit");
+        if (initProc == NULL) {
+            Ns_Log(Error, "%s: %s: Ns_DhcpPluginInit not found", module, argv[i]);
+            break;
+        }
+        plugin = &srvPtr->plugins.list[srvPtr->plugins.count];
+        plugin->name = ns_strdup(argv[i]);
+        if ((*initProc)(server, module, &pluginApi, plugin) != NS_OK) {
+            Ns_Log(Error, "%s: %s: plugin init failed", module, argv[i]);
+            break;
+        }
+        srvPtr->plugins.count++;
+        Ns_Log(Notice, "%s: loaded plugin %s", module, plugin->name);
+    }
+    Tcl_Free((char*)argv);
+    return i == argc ? NS_OK : NS_ERROR;
 }
 
-static int DHCPRequestReply(DHCPRequest *req)
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPPluginRequest --
+ *
+ *	Call classify hooks until one of them is done or selects the
+ *      range, then allocate hooks until one of them is done or sets
+ *      the reply type
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Range and reply of the request may be set
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPPluginRequest(DHCPRequest *req)
 {
-    u_int8_t *ptr;
-    u_int32_t ipaddr;
-    struct sockaddr_in sa;
-    int	size, port = 68;
+    int i;
+    Ns_DhcpPlugin *plugin;
+    DHCPServer *srvPtr = req->srvPtr;
 
-    if (req->out.giaddr) {
-        port = 67;
-        ipaddr = req->out.giaddr;
-    } else {
-        if (req->out.ciaddr) {
-            ipaddr = req->out.ciaddr;
-        } else
-        if (ntohs(req->in.flags) & BROADCAST_FLAG) {
-            ipaddr = INADDR_BROADCAST;
-        } else
-        if (req->out.yiaddr) {
-            ipaddr = req->out.yiaddr;
-        } else {
-            ipaddr = req->sa.sin_addr.s_addr;
+    for (i = 0; i < srvPtr->plugins.count && req->range == NULL; i++) {
+        plugin = &srvPtr->plugins.list[i];
+        if (plugin->classify != NULL && (*plugin->classify)(plugin->arg, req) == NS_DHCP_DONE) {
+            break;
         }
     }
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_addr.s_addr = ipaddr;
-    sa.sin_port = htons(port);
-    size = sizeof(DHCPPacket);
-    ptr = (unsigned char *) &req->out;
-    while (*(ptr + size - 1) == 0 && *(ptr + size - 2) == 0 && *(ptr + size - 3) == 0) {
-          size--;
-    }
-    size = sendto(req->sock, (char *) &req->out, size, 0, (struct sockaddr *) &sa, sizeof(sa));
-    if (req->srvPtr->debug > 3) {
-        Ns_DString ds;
-        Ns_DStringInit(&ds);
-        DHCPPrintRequest(&ds, req, 1);
-        Ns_Log(Debug, "nsdhcpd: reply %d bytes to %s:%d: %s", size, addr2str(ipaddr), port, ds.string);
-        Ns_DStringFree(&ds);
+    for (i = 0; i < srvPtr->plugins.count && req->reply.msgtype == 0; i++) {
+        plugin = &srvPtr->plugins.list[i];
+        if (plugin->allocate != NULL && (*plugin->allocate)(plugin->arg, req) == NS_DHCP_DONE) {
+            break;
+        }
     }
-    return size;
 }
 
-static void DHCPPrintRequest(Ns_DString *ds, DHCPRequest *req, int reply)
+static void DHCPPluginReply(DHCPRequest *req)
 {
-    u_int8_t *type;
-    DHCPPacket *pkt = reply ? &req->out : &req->in;
+    int i;
+    Ns_DhcpPlugin *plugin;
 
-    type = getOption(pkt, DHCP_MESSAGE_TYPE, 0, 0);
+    for (i = 0; i < req->srvPtr->plugins.count; i++) {
+        plugin = &req->srvPtr->plugins.list[i];
+        if (plugin->reply != NULL) {
+            (*plugin->reply)(plugin->arg, req);
+        }
+    }
+}
 
-    Ns_DStringPrintf(ds, "type %s from %s:%d hops %d flags %x xid %u ", getMessageName(type ? *type : 0),
-                          ns_inet_ntoa(req->sa.sin_addr), ntohs(req->sa.sin_port), pkt->hops, pkt->flags, pkt->xid);
-    Ns_DStringPrintf(ds, "yiaddr %s ", addr2str(pkt->yiaddr));
-    Ns_DStringPrintf(ds, "ciaddr %s ", addr2str(pkt->ciaddr));
-    Ns_DStringPrintf(ds, "giaddr %s ", addr2str(pkt->giaddr));
-    Ns_DStringPrintf(ds, "siaddr %s ", addr2str(pkt->siaddr));
-    Ns_DStringPrintf(ds, "macaddr %02x:%02x:%02x:%02x:%02x:%02x ",
-                          pkt->macaddr[0], pkt->macaddr[1], pkt->macaddr[2],
-                          pkt->macaddr[3], pkt->macaddr[4], pkt->macaddr[5]);
-    DHCPPrintOptions(ds, pkt, pkt->options, OPTION_SIZE, main_dict);
+/*
+ * Request access for plugins, see nsdhcpd.h
+ */
+
+static int DHCPPluginMsgType(Ns_DhcpRequest *req)
+{
+    return req->msgtype;
 }
 
-static void DHCPPrintOptions(Ns_DString *ds, DHCPPacket *pkt, u_int8_t *ptr, int length, DHCPDict *info)
+static const char *DHCPPluginMacaddr(Ns_DhcpRequest *req)
 {
-    char buf[256];
-    int i = 0, size, code, over = 0, mode = OPTION_FIELD;
+    return req->macaddr;
+}
 
-    while (i < length) {
-        code = ptr[i + OFFSET_CODE];
-        size = ptr[i + OFFSET_LEN];
-        switch (code) {
-        case DHCP_PADDING:
-             i++;
-             break;
+static const char *DHCPPluginClientid(Ns_DhcpRequest *req)
+{
+    return req->clientid;
+}
 
-        case DHCP_OPTION_OVERLOAD:
-             if (i + 1 + size >= length) {
-                 Ns_Log(Debug, "nsdhcpd: overload too long: code=%d, len=%d, %d > %d", code, size, i, length);
-                 return;
-             }
-             over = ptr[i + 3];
-             i += ptr[OFFSET_LEN] + 2;
-             break;
-
-        case DHCP_END:
-             if (mode == OPTION_FIELD && over & FILE_FIELD) {
-                 Ns_DStringPrintf(ds, "file %s ", pkt->file);
-             } else
-             if (mode == FILE_FIELD && over & SNAME_FIELD) {
-                 Ns_DStringPrintf(ds, "sname %s ", pkt->sname);
-             }
-             return;
-
-        case DHCP_FQDN:
-             //  Code   Len    Flags  RCODE1 RCODE2   Domain Name
-             // |  81  |   n  |      |      |      |       ...
-             //
-             //  0 1 2 3 4 5 6 7
-             //   MBZ   |N|E|O|S|
-
-             Ns_DStringPrintf(ds, "fqdn {%x %s} ", ptr[i + OFFSET_DATA], bin2hex(buf, ptr + i + OFFSET_DATA + 3, size - 3));
-             i += size + 2;
-             break;
-
-        default:
-             if (i + 1 + size >= length) {
-                 Ns_Log(Debug, "nsdhcpd: option too long: code=%d, len=%d, %d > %d", code, size, i + 1 + size, length);
-                 return;
-             }
-             if (info[code].next != NULL) {
-                 DHCPPrintOptions(ds, pkt, ptr + i + OFFSET_DATA, size, info[code].next);
-             }
-             DHCPPrintValue(ds, info[code].name, info[code].flags, size, ptr + i + OFFSET_DATA);
-             i += size + 2;
-        }
+static u_int32_t DHCPPluginGet(Ns_DhcpRequest *req, int field)
+{
+    switch (field) {
+    case NS_DHCP_XID:
+        return req->in.xid;
+    case NS_DHCP_CIADDR:
+        return req->in.ciaddr;
+    case NS_DHCP_YIADDR:
+        return req->in.yiaddr;
+    case NS_DHCP_SIADDR:
+        return req->in.siaddr;
+    case NS_DHCP_GIADDR:
+        return req->in.giaddr;
+    case NS_DHCP_REPLY_TYPE:
+        return req->reply.msgtype;
+    case NS_DHCP_REPLY_YIADDR:
+        return req->reply.yiaddr;
+    case NS_DHCP_REPLY_SIADDR:
+        return req->reply.siaddr;
+    case NS_DHCP_REPLY_NETMASK:
+        return req->reply.netmask;
+    case NS_DHCP_REPLY_GATEWAY:
+        return req->reply.gateway;
+    case NS_DHCP_REPLY_BROADCAST:
+        return req->reply.broadcast;
+    case NS_DHCP_REPLY_NAMESERVER:
+        return req->reply.nameserver;
+    case NS_DHCP_REPLY_LEASE_TIME:
+        return req->reply.lease_time;
     }
+    return 0;
 }
 
-static void DHCPPrintValue(Ns_DString *ds, char *name, u_int8_t type, u_int8_t size, u_int8_t *data)
+/* Same fields as ns_dhcpd reqset, addresses of the reply are taken from the request */
+static void DHCPPluginSet(Ns_DhcpRequest *req, int field, u_int32_t value)
 {
-    char buf[256];
-
-    Ns_DStringPrintf(ds, "%s ", name);
-    while (size > 0) {
-        switch (type & 0x00ff) {
-        case OPTION_IPADDR:
-            Ns_DStringPrintf(ds, "%s ", addr2str(*((u_int32_t*)(data))));
-            size -= 4;
-            data += 4;
-            break;
-
-        case OPTION_BOOLEAN:
-            Ns_DStringPrintf(ds, "%d ", *data);
-            size -= 1;
-            data += 1;
-            break;
+    switch (field) {
+    case NS_DHCP_CIADDR:
+        req->in.ciaddr = value;
+        break;
+    case NS_DHCP_YIADDR:
+    case NS_DHCP_REPLY_YIADDR:
+        req->in.yiaddr = value;
+        break;
+    case NS_DHCP_SIADDR:
+    case NS_DHCP_REPLY_SIADDR:
+        req->in.siaddr = value;
+        break;
+    case NS_DHCP_GIADDR:
+        req->in.giaddr = value;
+        break;
+    case NS_DHCP_REPLY_TYPE:
+        req->reply.msgtype = value;
+        break;
+    case NS_DHCP_REPLY_NETMASK:
+        req->reply.netmask = value;
+        break;
+    case NS_DHCP_REPLY_GATEWAY:
+        req->reply.gateway = value;
+        break;
+    case NS_DHCP_REPLY_BROADCAST:
+        req->reply.broadcast = value;
+        break;
+    case NS_DHCP_REPLY_NAMESERVER:
+        req->reply.nameserver = value;
+        break;
+    case NS_DHCP_REPLY_LEASE_TIME:
+        req->reply.lease_time = value;
+        break;
+    }
+}
 
-        case OPTION_U8:
-            Ns_DStringPrintf(ds, "%d ", *data);
-            size -= 1;
-            data += 1;
-            break;
+static const u_int8_t *DHCPPluginOption(Ns_DhcpRequest *req, int code, int subcode, int *size)
+{
+    u_int8_t *data;
 
-        case OPTION_S16:
-            Ns_DStringPrintf(ds, "%d ", ntohs(*((int16_t*)(data))));
-            size -= 2;
-            data += 2;
-            break;
+    if (code < 0 || code > 255 || subcode < 0 || subcode > 255) {
+        return NULL;
+    }
+    // Raw data with its wire size, decoded value sizes like FQDN skip bytes of the data
+    data = DHCPRequestOption(req, code, subcode, NULL);
+    if (data != NULL && size != NULL) {
+        *size = subcode > 0 ? req->index.agentsize[subcode] : req->index.size[code];
+    }
+    return data;
+}
 
-        case OPTION_U16:
-            Ns_DStringPrintf(ds, "%d ", ntohs(*((u_int16_t*)(data))));
-            size -= 2;
-            data += 2;
-            break;
+static int DHCPPluginSetOption(Ns_DhcpRequest *req, const char *name, const char *value)
+{
+    DHCPOption *opt = DHCPOptionCreate(name, value);
 
-        case OPTION_U32:
-            Ns_DStringPrintf(ds, "%d ", ntohl(*((u_int32_t*)(data))));
-            size -= 4;
-            data += 4;
-            break;
+    if (opt == NULL) {
+        return 0;
+    }
+    opt->next = req->reply.options;
+    req->reply.options = opt;
+    return 1;
+}
 
-        case OPTION_S32:
-            Ns_DStringPrintf(ds, "%u ", ntohl(*((int32_t*)(data))));
-            size -= 4;
-            data += 4;
-            break;
+static int DHCPPluginSetRange(Ns_DhcpRequest *req, u_int32_t ipaddr)
+{
+    req->range = DHCPRangeFindFast(req->srvPtr, ipaddr);
+    return req->range != NULL;
+}
 
-        default:
-            Ns_DStringPrintf(ds, "{%s} ", bin2hex(buf, data, size));
-            size = 0;
-            break;
-        }
+static int DHCPPluginRange(Ns_DhcpRequest *req, u_int32_t *start, u_int32_t *end)
+{
+    if (req->range == NULL) {
+        return 0;
     }
+    *start = htonl(req->range->start);
+    *end = htonl(req->range->end);
+    return 1;
 }
 
-static void DHCPSend(DHCPRequest *req, u_int8_t type)
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPFilterInit --
+ *
+ *	Parse list of glob patterns of the filter parameter
+ *
+ * Results:
+ *	Number of patterns
+ *
+ * Side effects:
+ *  	Allocates the list
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPFilterInit(const char *module, const char *name, char *value, CONST char ***list)
 {
-    int i, k;
-    char sent[256];
-    DHCPOption params, agent;
-    DHCPOption *opt, *options[2];
+    int argc = 0;
 
-    switch (type) {
-    case DHCP_DISCOVER:
-    case DHCP_REQUEST:
-    case DHCP_RELEASE:
-    case DHCP_INFORM:
-        req->out.op = BOOTREQUEST;
-        break;
-    default:
-        req->out.op = BOOTREPLY;
+    *list = NULL;
+    if (value != NULL && Tcl_SplitList(NULL, value, &argc, list) != TCL_OK) {
+        Ns_Log(Warning, "%s: invalid %s list: %s", module, name, value);
+        *list = NULL;
+        argc = 0;
     }
-    req->reply.msgtype = type;
-    req->out.htype = ETH_10MB;
-    req->out.hlen = ETH_10MB_LEN;
-    req->out.xid = req->in.xid;
-    req->out.hops = req->in.hops;
-    req->out.flags = req->in.flags;
-    req->out.ciaddr = req->in.ciaddr;
-    req->out.giaddr = req->in.giaddr;
-    req->out.yiaddr = req->reply.yiaddr;
-    req->out.siaddr = req->reply.siaddr;
-    req->out.cookie = htonl(DHCP_MAGIC);
-    memcpy(req->out.macaddr, req->in.macaddr, 6);
+    return argc;
+}
 
-    addOption8(req, DHCP_MESSAGE_TYPE, type);
-    addOption(req, DHCP_VENDOR_CLASS_IDENTIFIER, 7, "nsdhcpd");
-    addOptionIP(req, DHCP_SERVER_IDENTIFIER, req->srvPtr->ipaddr.sin_addr.s_addr);
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPFilterMatch --
+ *
+ *	Check the request against filter_vendor and filter_circuit patterns,
+ *      without any patterns every request matches
+ *
+ * Results:
+ *	1 if the message proc should be called, 0 otherwise
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
 
-    // Keep track of what we sent already
-    sent[DHCP_MESSAGE_TYPE] = sent[DHCP_AGENT_OPTIONS] = 1;
-    sent[DHCP_SERVER_IDENTIFIER] = sent[DHCP_VENDOR_CLASS_IDENTIFIER] = 1;
+static int DHCPFilterMatch(DHCPRequest *req)
+{
+    int i;
+    char buf[256];
+    u_int8_t *data;
+    DHCPOption opt;
+    DHCPServer *srvPtr = req->srvPtr;
 
-    if (req->reply.gateway) {
-        addOption32(req, DHCP_ROUTERS, req->reply.gateway);
-        sent[DHCP_ROUTERS] = 1;
-    }
-    if (req->reply.netmask) {
-        addOption32(req, DHCP_SUBNET_MASK, req->reply.netmask);
-        sent[DHCP_SUBNET_MASK] = 1;
-    }
-    if (req->reply.broadcast) {
-        addOption32(req, DHCP_BROADCAST_ADDRESS, req->reply.broadcast);
-        sent[DHCP_BROADCAST_ADDRESS] = 1;
+    if (srvPtr->filter.nvendor == 0 && srvPtr->filter.ncircuit == 0) {
+        return 1;
     }
-    if (req->reply.nameserver) {
-        addOption32(req, DHCP_DOMAIN_NAME_SERVERS, req->reply.nameserver);
-        sent[DHCP_DOMAIN_NAME_SERVERS] = 1;
+    if (srvPtr->filter.nvendor > 0 &&
+        (data = DHCPRequestOption(req, DHCP_VENDOR_CLASS_IDENTIFIER, 0, &opt)) != NULL) {
+        memcpy(buf, data, opt.size);
+        buf[opt.size] = 0;
+        for (i = 0; i < srvPtr->filter.nvendor; i++) {
+            if (Tcl_StringMatch(buf, srvPtr->filter.vendor[i])) {
+                return 1;
+            }
+        }
     }
-    if (req->reply.lease_time) {
-        int lease_time = req->reply.lease_time / 2;
-        addOption32(req, DHCP_LEASE_TIME, req->reply.lease_time);
-        addOption32(req, DHCP_RENEWAL_TIME, lease_time);
-        lease_time = req->reply.lease_time / 2 + req->reply.lease_time / 4;
-        addOption32(req, DHCP_REBINDING_TIME, lease_time);
-        sent[DHCP_LEASE_TIME] = sent[DHCP_RENEWAL_TIME] = sent[DHCP_REBINDING_TIME] = 1;
+    if (srvPtr->filter.ncircuit > 0 &&
+        (data = DHCPRequestOption(req, DHCP_AGENT_OPTIONS, DHCP_AGENT_CIRCUIT_ID, &opt)) != NULL) {
+        memcpy(buf, data, opt.size);
+        buf[opt.size] = 0;
+        for (i = 0; i < srvPtr->filter.ncircuit; i++) {
+            if (Tcl_StringMatch(buf, srvPtr->filter.circuit[i])) {
+                return 1;
+            }
+        }
     }
-    params.size = 0;
-    getOption(&req->in, DHCP_PARAMETER_REQUEST_LIST, 0, &params);
+    return 0;
+}
 
-    // Return all options
-    options[0] = req->reply.options;
-    options[1] = req->range->reply;
-    memset(sent, 0, sizeof(sent));
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRequestDict --
+ *
+ *	Build dict of request header fields and options in one pass, names
+ *      are the same as reqget takes, numbers are returned as integers and
+ *      repeated values as lists. With names only those names are returned.
+ *
+ * Results:
+ *	Tcl dict object
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
 
-    for (k = 0; k < 2; k++) {
-        for (opt = options[k]; opt; opt = opt->next) {
+static Tcl_Obj *DHCPRequestDict(DHCPRequest *req, Tcl_Obj *names)
+{
+    int i, count;
+    u_int8_t *ptr;
+    DHCPDict *dict;
+    DHCPOption option;
+    Tcl_Obj **items, *obj, *result = Tcl_NewDictObj();
+    static CONST char *fields[] = {
+        "type", "xid", "ipaddr", "yiaddr", "siaddr", "giaddr", "ciaddr", "range", "lease_time", "lease", NULL
+    };
 
-            if (sent[opt->dict->code]) {
-                continue;
+    if (names != NULL) {
+        if (Tcl_ListObjGetElements(NULL, names, &count, &items) != TCL_OK) {
+            return result;
+        }
+        for (i = 0; i < count; i++) {
+            obj = DHCPRequestField(req, Tcl_GetString(items[i]));
+            if (obj == NULL && (dict = getDict(Tcl_GetString(items[i]))) != NULL &&
+                (ptr = DHCPRequestOption(req, dict->code, dict->subcode, &option)) != NULL) {
+                obj = DHCPValueObj(option.dict->flags, option.size, ptr);
             }
-
-            // If parameter list was provided, skip not-requested options
-            if (params.size > 0) {
-                for (i = 0; i < params.size; i++) {
-                    if (params.ptr[i] == opt->dict->code) {
-                       break;
-                    }
-                }
-                if (i >= params.size) {
-                    continue;
-                }
+            if (obj != NULL) {
+                Tcl_DictObjPut(NULL, result, items[i], obj);
             }
-            sent[opt->dict->code] = 1;
-
-            /*
-             * Each complex option will be placed with one suboption,
-             * this is not optimized but simple. Later we will merge them all into one
-             * option with all suboptions
-             */
+        }
+        return result;
+    }
 
-            if (opt->dict->subcode) {
-                addOption(req, opt->dict->code, opt->size + 2, NULL);
-                addOption(req, opt->dict->subcode, opt->size, opt->ptr);
-            } else {
-                addOption(req, opt->dict->code, opt->size, opt->ptr);
-            }
+    for (i = 0; fields[i] != NULL; i++) {
+        Tcl_DictObjPut(NULL, result, Tcl_NewStringObj(fields[i], -1), DHCPRequestField(req, fields[i]));
+    }
+    for (i = 1; i < DHCP_END; i++) {
+        if ((ptr = DHCPRequestOption(req, i, 0, &option)) != NULL) {
+            obj = option.dict->name ? Tcl_NewStringObj(option.dict->name, -1) : Tcl_NewIntObj(i);
+            Tcl_DictObjPut(NULL, result, obj, DHCPValueObj(option.dict->flags, option.size, ptr));
         }
     }
-    // We must return agent option back
-    if (getOption(&req->in, DHCP_AGENT_OPTIONS, 0, &agent) != NULL) {
-        addOption(req, DHCP_AGENT_OPTIONS, agent.size, agent.ptr);
+    for (i = 1; req->index.offset[DHCP_AGENT_OPTIONS] && i < 256; i++) {
+        if ((ptr = DHCPRequestOption(req, DHCP_AGENT_OPTIONS, i, &option)) != NULL) {
+            Tcl_DictObjPut(NULL, result, Tcl_NewStringObj(option.dict->name, -1),
+                           DHCPValueObj(option.dict->flags, option.size, ptr));
+        }
     }
-    addOption(req, DHCP_END, 0, NULL);
-    DHCPRequestReply(req);
+    return result;
 }
 
-static void DHCPProcessDiscover(DHCPRequest *req)
+/* Header field of the request as reqget returns it, NULL if not a header field */
+static Tcl_Obj *DHCPRequestField(DHCPRequest *req, const char *name)
 {
+    Ns_DString ds;
+    Tcl_Obj *obj;
     DHCPLease *lease;
 
-    req->range = DHCPRangeFind(req);
-    if (req->range == NULL ||
-        (!(lease = DHCPLeaseFind(req->range, 0, req->macaddr)) &&
-         !(lease = DHCPLeaseAlloc(req->range)))) {
-        return;
+    if (!strcmp(name, "type")) {
+        return Tcl_NewStringObj(getMessageName(req->msgtype), -1);
     }
-    // Make it short till next REQUEST packet
-    req->reply.lease_time = 60;
-    lease->expires = time(0) + 60;
-    strcpy(lease->macaddr, req->macaddr);
-
-    req->reply.yiaddr = lease->ipaddr;
-    DHCPSend(req, DHCP_OFFER);
+    if (!strcmp(name, "xid")) {
+        return Tcl_NewWideIntObj(req->in.xid);
+    }
+    if (!strcmp(name, "ipaddr")) {
+        return Tcl_NewStringObj(ns_inet_ntoa(req->sa.sin_addr), -1);
+    }
+    if (!strcmp(name, "yiaddr")) {
+        return Tcl_NewStringObj(addr2str(req->in.yiaddr), -1);
+    }
+    if (!strcmp(name, "siaddr")) {
+        return Tcl_NewStringObj(addr2str(req->in.siaddr), -1);
+    }
+    if (!strcmp(name, "giaddr")) {
+        return Tcl_NewStringObj(addr2str(req->in.giaddr), -1);
+    }
+    if (!strcmp(name, "ciaddr")) {
+        return Tcl_NewStringObj(addr2str(req->in.ciaddr), -1);
+    }
+    if (!strcmp(name, "lease_time")) {
+        return Tcl_NewWideIntObj(req->reply.lease_time);
+    }
+    if (!strcmp(name, "lease")) {
+        Ns_DStringInit(&ds);
+        if ((lease = DHCPRequestLease(req)) != NULL) {
+            Ns_DStringPrintf(&ds, "%s %s %u %u", addr2str(lease->ipaddr), lease->macaddr, lease->lease_time, lease->expires);
+        }
+        obj = Tcl_NewStringObj(ds.string, ds.length);
+        Ns_DStringFree(&ds);
+        return obj;
+    }
+    if (!strcmp(name, "range")) {
+        Ns_DStringInit(&ds);
+        if (req->range != NULL) {
+            DHCPRangeList(req->range, &ds);
+        }
+        obj = Tcl_NewStringObj(ds.string, ds.length);
+        Ns_DStringFree(&ds);
+        return obj;
+    }
+    return NULL;
 }
 
-static void DHCPProcessRequest(DHCPRequest *req)
+/* Lease of the reply address, looked up once, queued trace events carry the copy */
+static DHCPLease *DHCPRequestLease(DHCPRequest *req)
 {
-    DHCPOption ipaddr;
-    DHCPLease *lease;
-
-    req->range = DHCPRangeFind(req);
-    if (req->range == NULL || !getOption(&req->in, DHCP_REQUESTED_ADDRESS, 0, &ipaddr)) {
-        return;
+    if (!req->leased && req->range != NULL && req->reply.yiaddr != 0) {
+        req->leased = 1;
+        if (DHCPLeaseFind(req->range, req->reply.yiaddr, NULL, NULL, &req->lease) == NULL) {
+            req->lease.ipaddr = 0;
+        }
     }
-    if (!(lease = DHCPLeaseFind(req->range, ipaddr.value.u32, req->macaddr))) {
-        DHCPSendNAK(req);
-        return;
+    return req->leased && req->lease.ipaddr != 0 ? &req->lease : NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRequestSet --
+ *
+ *	Set one reply field or add reply option, used by reqset
+ *
+ * Results:
+ *	TCL_OK or TCL_ERROR for unknown option
+ *
+ * Side effects:
+ *  	Reply of the request is modified
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPRequestSet(Tcl_Interp *interp, DHCPRequest *req, char *name, char *value)
+{
+    DHCPOption *opt;
+
+    if (!strcasecmp(name, "type")) {
+        req->reply.msgtype = getMessageID(value);
+    } else
+    if (!strcmp(name, "yiaddr")) {
+        req->in.yiaddr = inet_addr(value);
+    } else
+    if (!strcmp(name, "siaddr")) {
+        req->in.siaddr = inet_addr(value);
+    } else
+    if (!strcmp(name, "giaddr")) {
+        req->in.giaddr = inet_addr(value);
+    } else
+    if (!strcmp(name, "ciaddr")) {
+        req->in.ciaddr = inet_addr(value);
+    } else
+    if (!strcmp(name, "network")) {
+        req->reply.netmask = inet_addr(value);
+    } else
+    if (!strcmp(name, "broadcast")) {
+        req->reply.broadcast = inet_addr(value);
+    } else
+    if (!strcmp(name, "gateway")) {
+        req->reply.gateway = inet_addr(value);
+    } else
+    if (!strcmp(name, "nameserver")) {
+        req->reply.nameserver = inet_addr(value);
+    } else
+    if (!strcmp(name, "lease_time")) {
+        req->reply.lease_time = atol(value);
+    } else {
+        opt = DHCPOptionCreate(name, value);
+        if (opt == NULL) {
+            Tcl_AppendResult(interp, "unknown option: ", name, NULL);
+            return TCL_ERROR;
+        }
+        opt->next = req->reply.options;
+        req->reply.options = opt;
+    }
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPTraceQueue --
+ *
+ *	Queue copy of the processed request with its reply for trace
+ *      threads, the event is dropped when the queue is full
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Trace thread is woken up
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPTraceQueue(DHCPRequest *req)
+{
+    DHCPRequest *ev;
+    DHCPServer *srvPtr = req->srvPtr;
+    u_int64_t dropped = 0;
+
+    // Lease as it was when the reply was sent, not when the trace runs
+    DHCPRequestLease(req);
+
+    ev = (DHCPRequest*)DHCPSlabAlloc(SLAB_REQUEST);
+    memcpy(ev, req, sizeof(DHCPRequest));
+    ev->parser.ptr = ev->out.options + (req->parser.ptr - req->out.options);
+    ev->parser.end = ev->out.options + OPTION_SIZE;
+    ev->reply.options = DHCPOptionCopy(req->reply.options);
+    ev->rangestart = req->range != NULL ? req->range->start : 0;
+    ev->range = NULL;
+    ev->batch = NULL;
+    ev->queued = 0;
+    ev->cached = 0;
+    ev->nextPtr = NULL;
+
+    Ns_MutexLock(&srvPtr->trace.lock);
+    if (srvPtr->trace.count >= srvPtr->trace.size) {
+        dropped = ++srvPtr->trace.dropped;
+    } else {
+        if (srvPtr->trace.tail != NULL) {
+            srvPtr->trace.tail->nextPtr = ev;
+        } else {
+            srvPtr->trace.head = ev;
+        }
+        srvPtr->trace.tail = ev;
+        srvPtr->trace.count++;
+        srvPtr->trace.queued++;
+        Ns_CondSignal(&srvPtr->trace.cond);
+    }
+    Ns_MutexUnlock(&srvPtr->trace.lock);
+
+    if (dropped > 0) {
+        DHCPRequestFree(ev);
+        if (dropped % 1000 == 1) {
+            Ns_Log(Warning, "nsdhcpd: trace queue is full, %llu events dropped", (unsigned long long)dropped);
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPTraceThread --
+ *
+ *	Takes batches of trace events from the queue and runs trace_proc
+ *      for each of them in one allocated interp, ns_dhcpd reqget and
+ *      reqlist see the queued copy of the request.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPTraceThread(void *arg)
+{
+    int count;
+    Tcl_Interp *interp;
+    DHCPScripts *scripts;
+    DHCPRequest *events, *ev;
+    DHCPServer *srvPtr = (DHCPServer*)arg;
+
+    Ns_ThreadSetName("-nsdhcpd:trace-");
+
+    Ns_MutexLock(&srvPtr->trace.lock);
+    while (!srvPtr->trace.shutdown) {
+        if (srvPtr->trace.head == NULL) {
+            Ns_CondWait(&srvPtr->trace.cond, &srvPtr->trace.lock);
+            continue;
+        }
+        events = ev = srvPtr->trace.head;
+        for (count = 1; count < srvPtr->trace.batch && ev->nextPtr != NULL; count++) {
+            ev = ev->nextPtr;
+        }
+        srvPtr->trace.head = ev->nextPtr;
+        if (srvPtr->trace.head == NULL) {
+            srvPtr->trace.tail = NULL;
+        }
+        ev->nextPtr = NULL;
+        srvPtr->trace.count -= count;
+        Ns_MutexUnlock(&srvPtr->trace.lock);
+
+        interp = Ns_TclAllocateInterp(srvPtr->name);
+        scripts = DHCPScriptsGet(srvPtr, interp);
+        while ((ev = events) != NULL) {
+            events = ev->nextPtr;
+            // Per event, a long batch must not hold back retired ranges
+            DHCPRangeEnter(srvPtr);
+            if (ev->rangestart) {
+                ev->range = DHCPRangeFindFast(srvPtr, htonl(ev->rangestart));
+                if (ev->range != NULL && ev->range->start != ev->rangestart) {
+                    ev->range = NULL;
+                }
+            }
+            Ns_TlsSet(&reqTls, ev);
+            if (Tcl_EvalObjEx(interp, scripts->trace, 0) != TCL_OK) {
+                Ns_TclLogError(interp);
+            }
+            Ns_TlsSet(&reqTls, 0);
+            DHCPRangeLeave(srvPtr);
+            DHCPRequestFree(ev);
+        }
+        Ns_TclDeAllocateInterp(interp);
+
+        Ns_MutexLock(&srvPtr->trace.lock);
+        srvPtr->trace.processed += count;
+    }
+    srvPtr->trace.running--;
+    Ns_CondBroadcast(&srvPtr->trace.cond);
+    Ns_MutexUnlock(&srvPtr->trace.lock);
+}
+
+static void DHCPTraceShutdown(const Ns_Time *toPtr, void *arg)
+{
+    DHCPServer *srvPtr = (DHCPServer*)arg;
+
+    Ns_MutexLock(&srvPtr->trace.lock);
+    if (toPtr == NULL) {
+        srvPtr->trace.shutdown = 1;
+        Ns_CondBroadcast(&srvPtr->trace.cond);
+    } else {
+        while (srvPtr->trace.running > 0) {
+            if (Ns_CondTimedWait(&srvPtr->trace.cond, &srvPtr->trace.lock, toPtr) != NS_OK) {
+                break;
+            }
+        }
+    }
+    Ns_MutexUnlock(&srvPtr->trace.lock);
+}
+
+/* Report trace queue counters as a Tcl list */
+static void DHCPTraceStats(DHCPServer *srvPtr, Ns_DString *ds)
+{
+    Ns_MutexLock(&srvPtr->trace.lock);
+    Ns_DStringPrintf(ds, "threads %d pending %d queued %llu processed %llu dropped %llu",
+                     srvPtr->trace.threads, srvPtr->trace.count,
+                     (unsigned long long)srvPtr->trace.queued,
+                     (unsigned long long)srvPtr->trace.processed,
+                     (unsigned long long)srvPtr->trace.dropped);
+    Ns_MutexUnlock(&srvPtr->trace.lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPScriptsGet --
+ *
+ *	Returns message procs and trace_proc script objects kept in the interp,
+ *      evaluating the same objects lets Tcl reuse compiled bytecode and
+ *      recompile only when its own epochs change. Interps which are
+ *      deleted or recreated by the server lose the cache with them.
+ *
+ * Results:
+ *	Scripts of the interp
+ *
+ * Side effects:
+ *  	Creates AssocData on first use
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPScripts *DHCPScriptsGet(DHCPServer *srvPtr, Tcl_Interp *interp)
+{
+    DHCPScripts *scripts = (DHCPScripts*)Tcl_GetAssocData(interp, srvPtr->scripts, NULL);
+
+    if (scripts == NULL) {
+        int i, j;
+
+        scripts = ns_calloc(1, sizeof(DHCPScripts));
+        for (i = 0; i <= DHCP_INFORM; i++) {
+            if (srvPtr->procs[i] == NULL) {
+                continue;
+            }
+            for (j = 0; j < i && srvPtr->procs[j] != srvPtr->procs[i]; j++);
+            scripts->run[i] = j < i ? scripts->run[j] : Tcl_NewStringObj(srvPtr->procs[i], -1);
+            Tcl_IncrRefCount(scripts->run[i]);
+        }
+        if (srvPtr->trace_proc != NULL) {
+            scripts->trace = Tcl_NewStringObj(srvPtr->trace_proc, -1);
+            Tcl_IncrRefCount(scripts->trace);
+        }
+        Tcl_SetAssocData(interp, srvPtr->scripts, DHCPScriptsFree, scripts);
+    }
+    return scripts;
+}
+
+static void DHCPScriptsFree(ClientData arg, Tcl_Interp *interp)
+{
+    int i;
+    DHCPScripts *scripts = (DHCPScripts*)arg;
+
+    for (i = 0; i <= DHCP_INFORM; i++) {
+        if (scripts->run[i] != NULL) {
+            Tcl_DecrRefCount(scripts->run[i]);
+        }
+    }
+    if (scripts->trace != NULL) {
+        Tcl_DecrRefCount(scripts->trace);
+    }
+    ns_free(scripts);
+}
+
+static void DHCPRequestFree(DHCPRequest *req)
+{
+    if (req != NULL) {
+        DHCPOptionFree(req->reply.options);
+        req->reply.options = NULL;
+        if (!req->cached) {
+            DHCPSlabFree(SLAB_REQUEST, req);
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRequestLength --
+ *
+ *	Length of the reply encoded so far, optionally padded with zeros
+ *      after the end option up to BOOTP minimum of 300 bytes or up to the
+ *      maximum message size the client announced
+ *
+ * Results:
+ *	Number of bytes to send
+ *
+ * Side effects:
+ *  	Padding is zeroed in the reply
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPRequestLength(DHCPRequest *req)
+{
+    int len, size = 0;
+    DHCPOption maxsize;
+
+    len = req->parser.ptr - (u_int8_t *) &req->out;
+    switch (req->srvPtr->padding) {
+    case PAD_MAXSIZE:
+        if (DHCPRequestOption(req, DHCP_MAX_MESSAGE_SIZE, 0, &maxsize) != NULL && maxsize.size == 2) {
+            size = maxsize.value.u16 - UDP_HEADERS_SIZE;
+        }
+        /* fall through */
+
+    case PAD_BOOTP:
+        if (size < BOOTP_MIN_SIZE) {
+            size = BOOTP_MIN_SIZE;
+        }
+        if (size > sizeof(DHCPPacket)) {
+            size = sizeof(DHCPPacket);
+        }
+        if (len < size) {
+            memset(req->parser.ptr, 0, size - len);
+            len = size;
+        }
+        break;
+    }
+    return len;
+}
+
+static int DHCPRequestSend(DHCPRequest *req, u_int32_t ipaddr, int port)
+{
+    int len;
+    struct sockaddr_in sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = ipaddr;
+    sa.sin_port = htons(port);
+    len = DHCPRequestLength(req);
+    return sendto(req->sock, (char *) &req->out, len, 0, (struct sockaddr *) &sa, sizeof(sa));
+}
+
+static int DHCPRequestReply(DHCPRequest *req)
+{
+    u_int32_t ipaddr;
+    struct sockaddr_in sa;
+    int	size, port = 68;
+
+    if (req->out.giaddr) {
+        port = 67;
+        ipaddr = req->out.giaddr;
+    } else {
+        if (req->out.ciaddr) {
+            ipaddr = req->out.ciaddr;
+        } else
+        if (ntohs(req->in.flags) & BROADCAST_FLAG) {
+            ipaddr = INADDR_BROADCAST;
+        } else
+        if (req->out.yiaddr) {
+            ipaddr = req->out.yiaddr;
+        } else {
+            ipaddr = req->sa.sin_addr.s_addr;
+        }
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = ipaddr;
+    sa.sin_port = htons(port);
+    size = DHCPRequestLength(req);
+    if (req->batch != NULL) {
+        DHCPBatchQueue(req->batch, req, &sa, size);
+    } else {
+        size = sendto(req->sock, (char *) &req->out, size, 0, (struct sockaddr *) &sa, sizeof(sa));
+    }
+    if (req->srvPtr->debug > 3) {
+        Ns_DString ds;
+        Ns_DStringInit(&ds);
+        DHCPPrintRequest(&ds, req, 1);
+        Ns_Log(Debug, "nsdhcpd: reply %d bytes to %s:%d: %s", size, addr2str(ipaddr), port, ds.string);
+        Ns_DStringFree(&ds);
+    }
+    return size;
+}
+
+static void DHCPPrintRequest(Ns_DString *ds, DHCPRequest *req, int reply)
+{
+    u_int8_t *type;
+    DHCPPacket *pkt = reply ? &req->out : &req->in;
+
+    type = getOption(pkt, DHCP_MESSAGE_TYPE, 0, 0);
+
+    Ns_DStringPrintf(ds, "type %s from %s:%d hops %d flags %x xid %u ", getMessageName(type ? *type : 0),
+                          ns_inet_ntoa(req->sa.sin_addr), ntohs(req->sa.sin_port), pkt->hops, pkt->flags, pkt->xid);
+    Ns_DStringPrintf(ds, "yiaddr %s ", addr2str(pkt->yiaddr));
+    Ns_DStringPrintf(ds, "ciaddr %s ", addr2str(pkt->ciaddr));
+    Ns_DStringPrintf(ds, "giaddr %s ", addr2str(pkt->giaddr));
+    Ns_DStringPrintf(ds, "siaddr %s ", addr2str(pkt->siaddr));
+    Ns_DStringPrintf(ds, "macaddr %02x:%02x:%02x:%02x:%02x:%02x ",
+                          pkt->macaddr[0], pkt->macaddr[1], pkt->macaddr[2],
+                          pkt->macaddr[3], pkt->macaddr[4], pkt->macaddr[5]);
+    DHCPPrintOptions(ds, pkt, pkt->options, OPTION_SIZE, main_dict);
+}
+
+static void DHCPPrintOptions(Ns_DString *ds, DHCPPacket *pkt, u_int8_t *ptr, int length, DHCPDict *info)
+{
+    char buf[256];
+    int i = 0, size, code, over = 0, mode = OPTION_FIELD;
+
+    while (i < length) {
+        code = ptr[i + OFFSET_CODE];
+        size = ptr[i + OFFSET_LEN];
+        switch (code) {
+        case DHCP_PADDING:
+             i++;
+             break;
+
+        case DHCP_OPTION_OVERLOAD:
+             if (i + 1 + size >= length) {
+                 Ns_Log(Debug, "nsdhcpd: overload too long: code=%d, len=%d, %d > %d", code, size, i, length);
+                 return;
+             }
+             over = ptr[i + 3];
+             i += ptr[OFFSET_LEN] + 2;
+             break;
+
+        case DHCP_END:
+             if (mode == OPTION_FIELD && over & FILE_FIELD) {
+                 Ns_DStringPrintf(ds, "file %s ", pkt->file);
+             } else
+             if (mode == FILE_FIELD && over & SNAME_FIELD) {
+                 Ns_DStringPrintf(ds, "sname %s ", pkt->sname);
+             }
+             return;
+
+        case DHCP_FQDN:
+             //  Code   Len    Flags  RCODE1 RCODE2   Domain Name
+             // |  81  |   n  |      |      |      |       ...
+             //
+             //  0 1 2 3 4 5 6 7
+             //   MBZ   |N|E|O|S|
+
+             Ns_DStringPrintf(ds, "fqdn {%x %s} ", ptr[i + OFFSET_DATA], bin2hex(buf, ptr + i + OFFSET_DATA + 3, size - 3));
+             i += size + 2;
+             break;
+
+        default:
+             if (i + 1 + size >= length) {
+                 Ns_Log(Debug, "nsdhcpd: option too long: code=%d, len=%d, %d > %d", code, size, i + 1 + size, length);
+                 return;
+             }
+             if (info[code].next != NULL) {
+                 DHCPPrintOptions(ds, pkt, ptr + i + OFFSET_DATA, size, info[code].next);
+             }
+             DHCPPrintValue(ds, info[code].name, info[code].flags, size, ptr + i + OFFSET_DATA);
+             i += size + 2;
+        }
+    }
+}
+
+static void DHCPPrintValue(Ns_DString *ds, char *name, u_int8_t type, u_int8_t size, u_int8_t *data)
+{
+    char buf[256];
+
+    Ns_DStringPrintf(ds, "%s ", name);
+    while (size > 0) {
+        switch (type & 0x00ff) {
+        case OPTION_IPADDR:
+            Ns_DStringPrintf(ds, "%s ", addr2str(*((u_int32_t*)(data))));
+            size -= 4;
+            data += 4;
+            break;
+
+        case OPTION_BOOLEAN:
+            Ns_DStringPrintf(ds, "%d ", *data);
+            size -= 1;
+            data += 1;
+            break;
+
+        case OPTION_U8:
+            Ns_DStringPrintf(ds, "%d ", *data);
+            size -= 1;
+            data += 1;
+            break;
+
+        case OPTION_S16:
+            Ns_DStringPrintf(ds, "%d ", ntohs(*((int16_t*)(data))));
+            size -= 2;
+            data += 2;
+            break;
+
+        case OPTION_U16:
+            Ns_DStringPrintf(ds, "%d ", ntohs(*((u_int16_t*)(data))));
+            size -= 2;
+            data += 2;
+            break;
+
+        case OPTION_U32:
+            Ns_DStringPrintf(ds, "%d ", ntohl(*((u_int32_t*)(data))));
+            size -= 4;
+            data += 4;
+            break;
+
+        case OPTION_S32:
+            Ns_DStringPrintf(ds, "%u ", ntohl(*((int32_t*)(data))));
+            size -= 4;
+            data += 4;
+            break;
+
+        default:
+            Ns_DStringPrintf(ds, "{%s} ", bin2hex(buf, data, size));
+            size = 0;
+            break;
+        }
+    }
+}
+
+/* Option value as Tcl object, same formats as DHCPPrintValue with native numbers */
+static Tcl_Obj *DHCPValueObj(unsigned int flags, u_int8_t size, u_int8_t *data)
+{
+    int n, count = 0;
+    char buf[520];
+    u_int16_t u16;
+    u_int32_t u32;
+    Tcl_Obj *items[256];
+
+    while (size > 0) {
+        n = getTypeSize(flags);
+        if ((flags & 0x00ff) == OPTION_STRING || n == 0 || n > size) {
+            items[count++] = Tcl_NewStringObj(bin2hex(buf, data, size), -1);
+            break;
+        }
+        switch (flags & 0x00ff) {
+        case OPTION_IPADDR:
+            memcpy(&u32, data, 4);
+            items[count++] = Tcl_NewStringObj(addr2str(u32), -1);
+            break;
+
+        case OPTION_BOOLEAN:
+            items[count++] = Tcl_NewBooleanObj(*data);
+            break;
+
+        case OPTION_U8:
+            items[count++] = Tcl_NewIntObj(*data);
+            break;
+
+        case OPTION_S16:
+            memcpy(&u16, data, 2);
+            items[count++] = Tcl_NewIntObj((int16_t)ntohs(u16));
+            break;
+
+        case OPTION_U16:
+            memcpy(&u16, data, 2);
+            items[count++] = Tcl_NewIntObj(ntohs(u16));
+            break;
+
+        case OPTION_S32:
+            memcpy(&u32, data, 4);
+            items[count++] = Tcl_NewIntObj((int32_t)ntohl(u32));
+            break;
+
+        case OPTION_U32:
+            memcpy(&u32, data, 4);
+            items[count++] = Tcl_NewWideIntObj(ntohl(u32));
+            break;
+        }
+        size -= n;
+        data += n;
+    }
+    if (count == 1 && !(flags & OPTION_LIST)) {
+        return items[0];
+    }
+    return Tcl_NewListObj(count, items);
+}
+
+static void DHCPSend(DHCPRequest *req, u_int8_t type)
+{
+    int i, code;
+    u_int32_t sent[8], have[8];
+    DHCPOption params, agent;
+    DHCPOption *opt;
+    DHCPRangeOptions *options;
+
+    switch (type) {
+    case DHCP_DISCOVER:
+    case DHCP_REQUEST:
+    case DHCP_RELEASE:
+    case DHCP_INFORM:
+        req->out.op = BOOTREQUEST;
+        break;
+    default:
+        req->out.op = BOOTREPLY;
+    }
+    req->reply.msgtype = type;
+    req->out.htype = ETH_10MB;
+    req->out.hlen = ETH_10MB_LEN;
+    req->out.xid = req->in.xid;
+    req->out.hops = req->in.hops;
+    req->out.flags = req->in.flags;
+    req->out.ciaddr = req->in.ciaddr;
+    req->out.giaddr = req->in.giaddr;
+    req->out.yiaddr = req->reply.yiaddr;
+    req->out.siaddr = req->reply.siaddr;
+    req->out.cookie = htonl(DHCP_MAGIC);
+    memcpy(req->out.macaddr, req->in.macaddr, 6);
+
+    addOption8(req, DHCP_MESSAGE_TYPE, type);
+    addOption(req, DHCP_VENDOR_CLASS_IDENTIFIER, 7, "nsdhcpd");
+    addOptionIP(req, DHCP_SERVER_IDENTIFIER, req->srvPtr->ipaddr.sin_addr.s_addr);
+
+    // Keep track of what we sent already
+    memset(sent, 0, sizeof(sent));
+    BITMAP_SET(sent, DHCP_MESSAGE_TYPE);
+    BITMAP_SET(sent, DHCP_AGENT_OPTIONS);
+    BITMAP_SET(sent, DHCP_SERVER_IDENTIFIER);
+    BITMAP_SET(sent, DHCP_VENDOR_CLASS_IDENTIFIER);
+
+    if (req->reply.gateway) {
+        addOption32(req, DHCP_ROUTERS, req->reply.gateway);
+        BITMAP_SET(sent, DHCP_ROUTERS);
+    }
+    if (req->reply.netmask) {
+        addOption32(req, DHCP_SUBNET_MASK, req->reply.netmask);
+        BITMAP_SET(sent, DHCP_SUBNET_MASK);
+    }
+    if (req->reply.broadcast) {
+        addOption32(req, DHCP_BROADCAST_ADDRESS, req->reply.broadcast);
+        BITMAP_SET(sent, DHCP_BROADCAST_ADDRESS);
+    }
+    if (req->reply.nameserver) {
+        addOption32(req, DHCP_DOMAIN_NAME_SERVERS, req->reply.nameserver);
+        BITMAP_SET(sent, DHCP_DOMAIN_NAME_SERVERS);
+    }
+    if (req->reply.lease_time) {
+        int lease_time = req->reply.lease_time / 2;
+        addOption32(req, DHCP_LEASE_TIME, req->reply.lease_time);
+        addOption32(req, DHCP_RENEWAL_TIME, lease_time);
+        lease_time = req->reply.lease_time / 2 + req->reply.lease_time / 4;
+        addOption32(req, DHCP_REBINDING_TIME, lease_time);
+        BITMAP_SET(sent, DHCP_LEASE_TIME);
+        BITMAP_SET(sent, DHCP_RENEWAL_TIME);
+        BITMAP_SET(sent, DHCP_REBINDING_TIME);
+    }
+    // Options set for this request take precedence over the range
+    memset(have, 0, sizeof(have));
+    for (opt = req->reply.options; opt; opt = opt->next) {
+        BITMAP_SET(have, opt->dict->code);
+    }
+    // Plugin may set the reply type without selecting a range, then only request options go out
+    options = req->range != NULL ? __atomic_load_n(&req->range->options, __ATOMIC_ACQUIRE) : NULL;
+
+    params.size = 0;
+    DHCPRequestOption(req, DHCP_PARAMETER_REQUEST_LIST, 0, &params);
+
+    if (params.size > 0) {
+        // Only requested options, in the order the client asked for them
+        for (i = 0; i < params.size; i++) {
+            code = params.ptr[i];
+            if (BITMAP_ISSET(sent, code)) {
+                continue;
+            }
+            if (BITMAP_ISSET(have, code)) {
+                for (opt = req->reply.options; opt; opt = opt->next) {
+                    if (opt->dict->code == code) {
+                        addOptionValue(req, opt);
+                        break;
+                    }
+                }
+            } else
+            if (options != NULL && options->tlv.length[code]) {
+                addOptionData(req, options->tlv.data + options->tlv.offset[code], options->tlv.length[code]);
+            }
+            BITMAP_SET(sent, code);
+        }
+    } else {
+        for (opt = req->reply.options; opt; opt = opt->next) {
+            code = opt->dict->code;
+            if (!BITMAP_ISSET(sent, code)) {
+                addOptionValue(req, opt);
+                BITMAP_SET(sent, code);
+            }
+        }
+        for (i = 0; options != NULL && i < options->tlv.size; i += options->tlv.data[i + 1] + 2) {
+            if (!BITMAP_ISSET(sent, options->tlv.data[i])) {
+                addOptionData(req, options->tlv.data + i, options->tlv.data[i + 1] + 2);
+            }
+        }
+    }
+    // We must return agent option back
+    if (DHCPRequestOption(req, DHCP_AGENT_OPTIONS, 0, &agent) != NULL) {
+        addOption(req, DHCP_AGENT_OPTIONS, agent.size, agent.ptr);
+    }
+    addOption(req, DHCP_END, 0, NULL);
+    DHCPRequestReply(req);
+}
+
+static void DHCPProcessDiscover(DHCPRequest *req)
+{
+    DHCPLease lease;
+
+    req->range = DHCPRangeFind(req);
+    if (req->range == NULL ||
+        (!DHCPLeaseFind(req->range, 0, req->macaddr, req->clientid, &lease) &&
+         !DHCPLeaseAlloc(req->range, req->macaddr, req->clientid, &lease))) {
+        return;
+    }
+    // Make it short till next REQUEST packet
+    req->reply.lease_time = 60;
+    DHCPLeaseRenew(req->range, lease.ipaddr, time(0) + 60);
+
+    req->reply.yiaddr = lease.ipaddr;
+    DHCPSend(req, DHCP_OFFER);
+}
+
+static void DHCPProcessRequest(DHCPRequest *req)
+{
+    DHCPOption ipaddr;
+    DHCPLease lease;
+
+    req->range = DHCPRangeFind(req);
+    if (req->range == NULL || !DHCPRequestOption(req, DHCP_REQUESTED_ADDRESS, 0, &ipaddr)) {
+        return;
+    }
+    if (!DHCPLeaseFind(req->range, ipaddr.value.u32, req->macaddr, req->clientid, &lease)) {
+        DHCPSendNAK(req);
+        return;
+    }
+    // Make normal lease time
+    req->reply.lease_time = lease.lease_time;
+    DHCPLeaseRenew(req->range, lease.ipaddr, time(0) + lease.lease_time);
+
+    req->reply.yiaddr = req->in.yiaddr;
+    req->reply.siaddr = req->in.siaddr;
+    DHCPSend(req, DHCP_ACK);
+}
+
+static void DHCPProcessInform(DHCPRequest *req)
+{
+    req->range = DHCPRangeFind(req);
+    if (req->range == NULL) {
+        return;
+    }
+
+    req->reply.yiaddr = req->in.yiaddr;
+    req->reply.siaddr = req->in.siaddr;
+    DHCPSend(req, DHCP_ACK);
+}
+
+static void DHCPProcessRelease(DHCPRequest *req)
+{
+}
+
+static void DHCPSendNAK(DHCPRequest *req)
+{
+    req->reply.msgtype = DHCP_NAK;
+    req->out.op = BOOTREPLY;
+    req->out.htype = ETH_10MB;
+    req->out.hlen = ETH_10MB_LEN;
+    req->out.xid = req->in.xid;
+    req->out.hops = req->in.hops;
+    req->out.flags = req->in.flags;
+    req->out.ciaddr = req->in.ciaddr;
+    req->out.giaddr = req->in.giaddr;
+    req->out.cookie = htonl(DHCP_MAGIC);
+    memcpy(req->out.macaddr, req->in.macaddr, 6);
+
+    addOption8(req, DHCP_MESSAGE_TYPE, DHCP_NAK);
+    addOption(req, DHCP_VENDOR_CLASS_IDENTIFIER, 7, "nsdhcpd");
+    addOptionIP(req, DHCP_SERVER_IDENTIFIER, req->srvPtr->ipaddr.sin_addr.s_addr);
+    addOption(req, DHCP_END, 0, NULL);
+
+    DHCPRequestReply(req);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPLeaseCreate --
+ *
+ *	Store new lease in the range replacing existing one for the same
+ *      address, shard of the address must be locked. Unlinked ranges
+ *      which readers may still hold get no new leases.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Lease is registered in the server index and the address is taken
+ *      from the free pool
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPLeaseCreate(DHCPRange *range, u_int32_t ipaddr, char *macaddr, char *clientid, u_int32_t lease_time, u_int32_t expires)
+{
+    int n;
+    DHCPLease *lease;
+    DHCPLeaseRecord *rec;
+    Tcl_HashEntry *entry;
+    DHCPShard *shard = DHCPShardGet(range, ipaddr);
+
+    if (range->dead) {
+        return;
+    }
+    DHCPLeaseFree(range, ipaddr);
+
+    if (clientid != NULL && !*clientid) {
+        clientid = NULL;
+    }
+    if (range->records != NULL) {
+        /* Dense ranges are swept by the expire thread, no timers needed */
+        rec = &range->records[ntohl(ipaddr) - range->start];
+        rec->state = LEASE_ACTIVE;
+        rec->flags = 0;
+        rec->expires = expires;
+        rec->lease_time = lease_time;
+        memset(rec->macaddr, 0, sizeof(rec->macaddr));
+        if (macaddr != NULL && *macaddr) {
+            hex2bin(rec->macaddr, macaddr, 6);
+            rec->flags |= LEASE_MACADDR;
+        }
+        if (clientid != NULL) {
+            entry = Tcl_CreateHashEntry(&shard->clientids, (char*)ipaddr, &n);
+            Tcl_SetHashValue(entry, ns_strdup(clientid));
+        }
+    } else {
+        lease = (DHCPLease*)DHCPSlabAlloc(SLAB_LEASE);
+        lease->ipaddr = ipaddr;
+        lease->expires = expires;
+        lease->lease_time = lease_time;
+        if (macaddr != NULL) {
+            strncpy(lease->macaddr, macaddr, 12);
+        }
+        if (clientid != NULL) {
+            lease->clientid = ns_strdup(clientid);
+        }
+        entry = Tcl_CreateHashEntry(&shard->leases, (char*)ipaddr, &n);
+        Tcl_SetHashValue(entry, (ClientData)lease);
+
+        /* Timer per hash lease, renewals only move the expiry */
+        lease->scheduled = expires;
+        DHCPExpireSchedule(range->srvPtr, ipaddr, expires);
+    }
+    DHCPIndexSet(range, ipaddr, macaddr, clientid);
+    DHCPPoolSet(shard, ipaddr, 1);
+    if (!range->loading) {
+        DHCPJournalWrite(range->srvPtr, JOURNAL_CREATE, ipaddr, macaddr, clientid, lease_time, expires);
+    }
+    if (range->srvPtr->debug > 1) {
+        Ns_Log(Notice, "LeaseCreate: %s %s %u", addr2str(ipaddr), macaddr ? macaddr : "", lease_time);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPLeaseGet --
+ *
+ *	Copy lease for the given address into the caller's structure,
+ *      shard of the address must be locked. Client id is only returned when buffer is
+ *      given.
+ *
+ * Results:
+ *	Pointer to the given lease structure or NULL if no lease
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPLease *DHCPLeaseGet(DHCPRange *range, u_int32_t ipaddr, DHCPLease *lease, Ns_DString *clientid)
+{
+    DHCPLeaseRecord *rec;
+    Tcl_HashEntry *entry;
+    u_int32_t n = ntohl(ipaddr);
+    DHCPShard *shard = DHCPShardGet(range, ipaddr);
+
+    if (shard == NULL) {
+        return NULL;
+    }
+    if (range->records != NULL) {
+        rec = &range->records[n - range->start];
+        if (rec->state != LEASE_ACTIVE) {
+            return NULL;
+        }
+        memset(lease, 0, sizeof(DHCPLease));
+        lease->ipaddr = ipaddr;
+        lease->expires = rec->expires;
+        lease->lease_time = rec->lease_time;
+        if (rec->flags & LEASE_MACADDR) {
+            bin2str(lease->macaddr, rec->macaddr, 6);
+        }
+        if (clientid != NULL && (entry = Tcl_FindHashEntry(&shard->clientids, (char*)ipaddr)) != NULL) {
+            Ns_DStringAppend(clientid, Tcl_GetHashValue(entry));
+        }
+    } else {
+        entry = Tcl_FindHashEntry(&shard->leases, (char*)ipaddr);
+        if (entry == NULL) {
+            return NULL;
+        }
+        *lease = *(DHCPLease*)Tcl_GetHashValue(entry);
+        if (clientid != NULL && lease->clientid != NULL) {
+            Ns_DStringAppend(clientid, lease->clientid);
+        }
+    }
+    lease->clientid = NULL;
+    return lease;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPLeaseFree --
+ *
+ *	Delete lease for the given address, shard of the address must be
+ *      locked
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Address is returned to the free pool
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPLeaseFree(DHCPRange *range, u_int32_t ipaddr)
+{
+    char macaddr[13];
+    DHCPLease *lease;
+    DHCPLeaseRecord *rec;
+    Tcl_HashEntry *entry;
+    char *clientid = NULL;
+    DHCPShard *shard = DHCPShardGet(range, ipaddr);
+
+    if (range->records != NULL) {
+        rec = &range->records[ntohl(ipaddr) - range->start];
+        if (rec->state != LEASE_ACTIVE) {
+            return;
+        }
+        macaddr[0] = 0;
+        if (rec->flags & LEASE_MACADDR) {
+            bin2str(macaddr, rec->macaddr, 6);
+        }
+        entry = Tcl_FindHashEntry(&shard->clientids, (char*)ipaddr);
+        if (entry != NULL) {
+            clientid = Tcl_GetHashValue(entry);
+            Tcl_DeleteHashEntry(entry);
+        }
+        DHCPIndexUnset(range, ipaddr, macaddr, clientid);
+        memset(rec, 0, sizeof(DHCPLeaseRecord));
+        ns_free(clientid);
+    } else {
+        entry = Tcl_FindHashEntry(&shard->leases, (char*)ipaddr);
+        if (entry == NULL) {
+            return;
+        }
+        lease = (DHCPLease*)Tcl_GetHashValue(entry);
+        Tcl_DeleteHashEntry(entry);
+        DHCPIndexUnset(range, ipaddr, lease->macaddr, lease->clientid);
+        ns_free(lease->clientid);
+        DHCPSlabFree(SLAB_LEASE, lease);
+    }
+    DHCPPoolSet(shard, ipaddr, 0);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPLeaseAlloc --
+ *
+ *	Allocate new lease from the free address pool of the range,
+ *      expired leases are returned to the pool by the expire thread.
+ *      Every allocation starts with the next shard, so concurrent
+ *      allocations are spread over the shard locks. When the pool is
+ *      exhausted, expired leases the expire thread has not reached yet
+ *      are reclaimed.
+ *
+ * Results:
+ *	Pointer to the given lease structure or NULL
+ *
+ * Side effects:
+ *  	Reclaimed leases are reported to expire hooks and expire_proc
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPLease *DHCPLeaseAlloc(DHCPRange *range, char *macaddr, char *clientid, DHCPLease *lease)
+{
+    int i;
+    unsigned int first;
+    DHCPShard *shard;
+    u_int32_t ipaddr, now = time(0);
+    DHCPLease *result = NULL;
+    DHCPExpireBatch batch;
+
+    first = __atomic_fetch_add(&range->nextshard, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < range->nshards && result == NULL; i++) {
+        shard = &range->shards[(first + i) % range->nshards];
+        Ns_MutexLock(&shard->lock);
+        if (!range->dead && DHCPPoolAlloc(shard, &ipaddr) == NS_OK) {
+            DHCPLeaseCreate(range, ipaddr, macaddr, clientid, range->lease_time, now + range->lease_time);
+            result = DHCPLeaseGet(range, ipaddr, lease, NULL);
+        }
+        Ns_MutexUnlock(&shard->lock);
+    }
+    if (result != NULL) {
+        return result;
+    }
+    memset(&batch, 0, sizeof(batch));
+    batch.srvPtr = range->srvPtr;
+    for (i = 0; i < range->nshards && result == NULL; i++) {
+        shard = &range->shards[(first + i) % range->nshards];
+        Ns_MutexLock(&shard->lock);
+        if (!range->dead && DHCPLeaseReclaim(&batch, range, shard, now) > 0 && DHCPPoolAlloc(shard, &ipaddr) == NS_OK) {
+            DHCPLeaseCreate(range, ipaddr, macaddr, clientid, range->lease_time, now + range->lease_time);
+            result = DHCPLeaseGet(range, ipaddr, lease, NULL);
+        }
+        Ns_MutexUnlock(&shard->lock);
+    }
+    // Reclaimed leases expired as if the expire thread had found them
+    DHCPExpireFlush(&batch);
+    if (batch.interp != NULL) {
+        Ns_TclDeAllocateInterp(batch.interp);
+    }
+    return result;
+}
+
+/*
+ * Free expired leases of the shard, shard must be locked, pending timers become
+ * stale. Leases are added to the batch, it is flushed by the caller after the
+ * shard is unlocked.
+ */
+static int DHCPLeaseReclaim(DHCPExpireBatch *batch, DHCPRange *range, DHCPShard *shard, u_int32_t now)
+{
+    int count = 0;
+    u_int32_t i;
+    DHCPLease *lease, buf;
+    DHCPLeaseRecord *rec;
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+
+    if (range->records != NULL) {
+        for (i = shard->start; i <= shard->end; i++) {
+            rec = &range->records[i - range->start];
+            if (rec->state == LEASE_ACTIVE && (int32_t)(rec->expires - now) < 0) {
+                buf.ipaddr = htonl(i);
+                buf.expires = rec->expires;
+                buf.lease_time = rec->lease_time;
+                buf.macaddr[0] = 0;
+                if (rec->flags & LEASE_MACADDR) {
+                    bin2str(buf.macaddr, rec->macaddr, 6);
+                }
+                entry = Tcl_FindHashEntry(&shard->clientids, (char*)buf.ipaddr);
+                DHCPExpireAppend(batch, &buf, entry ? Tcl_GetHashValue(entry) : NULL);
+                DHCPLeaseFree(range, buf.ipaddr);
+                count++;
+            }
+        }
+    } else {
+        entry = Tcl_FirstHashEntry(&shard->leases, &search);
+        while (entry != NULL) {
+            lease = (DHCPLease*)Tcl_GetHashValue(entry);
+            entry = Tcl_NextHashEntry(&search);
+            if ((int32_t)(lease->expires - now) < 0) {
+                DHCPExpireAppend(batch, lease, lease->clientid);
+                DHCPLeaseFree(range, lease->ipaddr);
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPLeaseFind --
+ *
+ *	Find lease by ip address, if not found and MAC address or client
+ *      identifier are given, resolve the lease through the range index.
+ *
+ * Results:
+ *	Pointer to the given lease structure or NULL
+ *
+ * Side effects:
+ *  	None, expired leases are left to the expire thread
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPLease *DHCPLeaseFind(DHCPRange *range, u_int32_t ipaddr, char *macaddr, char *clientid, DHCPLease *lease)
+{
+    DHCPShard *shard;
+    DHCPLease *result = NULL;
+
+    if (ipaddr != 0 && (shard = DHCPShardGet(range, ipaddr)) != NULL) {
+        Ns_MutexLock(&shard->lock);
+        result = DHCPLeaseGet(range, ipaddr, lease, NULL);
+        Ns_MutexUnlock(&shard->lock);
+    }
+    if (result == NULL && ((macaddr && *macaddr) || (clientid && *clientid))) {
+        ipaddr = DHCPIndexFind(range, macaddr, clientid);
+        if (ipaddr != 0 && (shard = DHCPShardGet(range, ipaddr)) != NULL) {
+            Ns_MutexLock(&shard->lock);
+            result = DHCPLeaseGet(range, ipaddr, lease, NULL);
+            Ns_MutexUnlock(&shard->lock);
+        }
+    }
+
+    // Check lease validity
+    if (result != NULL && result->expires < time(0)) {
+        result = NULL;
+    }
+    return result;
+}
+
+/*
+ * Update lease expiration. Timer of a hash lease is rescheduled when it fires
+ * if the lease was extended, shortened lease gets new timer at the earlier
+ * time and the old one becomes stale.
+ */
+static void DHCPLeaseRenew(DHCPRange *range, u_int32_t ipaddr, u_int32_t expires)
+{
+    DHCPLease *lease;
+    Tcl_HashEntry *entry;
+    DHCPShard *shard = DHCPShardGet(range, ipaddr);
+
+    Ns_MutexLock(&shard->lock);
+    if (range->dead) {
+        Ns_MutexUnlock(&shard->lock);
+        return;
+    }
+    if (range->records != NULL) {
+        range->records[ntohl(ipaddr) - range->start].expires = expires;
+    } else
+    if ((entry = Tcl_FindHashEntry(&shard->leases, (char*)ipaddr)) != NULL) {
+        lease = (DHCPLease*)Tcl_GetHashValue(entry);
+        lease->expires = expires;
+        if ((int32_t)(expires - lease->scheduled) < 0) {
+            lease->scheduled = expires;
+            DHCPExpireSchedule(range->srvPtr, ipaddr, expires);
+        }
+    }
+    DHCPJournalWrite(range->srvPtr, JOURNAL_RENEW, ipaddr, NULL, NULL, 0, expires);
+    Ns_MutexUnlock(&shard->lock);
+}
+
+static int DHCPLeaseAdd(DHCPServer *srvPtr, u_int32_t ipaddr, char *macaddr, char *clientid, u_int32_t lease_time, u_int32_t expires)
+{
+    DHCPRange *range;
+    DHCPShard *shard;
+
+    DHCPRangeEnter(srvPtr);
+    range = DHCPRangeFindFast(srvPtr, ipaddr);
+    if (range != NULL) {
+        shard = DHCPShardGet(range, ipaddr);
+        Ns_MutexLock(&shard->lock);
+        DHCPLeaseCreate(range, ipaddr, macaddr, clientid, lease_time, expires);
+        Ns_MutexUnlock(&shard->lock);
+    }
+    DHCPRangeLeave(srvPtr);
+    return range != NULL;
+}
+
+static void DHCPLeaseList(DHCPRange *range, Ns_DString *ds)
+{
+    int k;
+    u_int32_t i;
+    DHCPShard *shard;
+    DHCPLease *lease, buf;
+    DHCPLeaseRecord *rec;
+    Tcl_HashSearch search;
+    Tcl_HashEntry *entry;
+
+    for (k = 0; k < range->nshards; k++) {
+        shard = &range->shards[k];
+        Ns_MutexLock(&shard->lock);
+        if (range->records != NULL) {
+            for (i = shard->start; i <= shard->end; i++) {
+                rec = &range->records[i - range->start];
+                if (rec->state == LEASE_ACTIVE) {
+                    buf.macaddr[0] = 0;
+                    if (rec->flags & LEASE_MACADDR) {
+                        bin2str(buf.macaddr, rec->macaddr, 6);
+                    }
+                    Ns_DStringPrintf(ds, "%s %s %u %u ", addr2str(htonl(i)), buf.macaddr, rec->lease_time, rec->expires);
+                }
+            }
+        } else {
+            entry = Tcl_FirstHashEntry(&shard->leases, &search);
+            while (entry) {
+                lease = (DHCPLease*)Tcl_GetHashValue(entry);
+                Ns_DStringPrintf(ds, "%s %s %u %u ", addr2str(lease->ipaddr), lease->macaddr, lease->lease_time, lease->expires);
+                entry = Tcl_NextHashEntry(&search);
+            }
+        }
+        Ns_MutexUnlock(&shard->lock);
+    }
+}
+
+static void DHCPLeaseDel(DHCPServer *srvPtr, u_int32_t ipaddr)
+{
+    DHCPRange *range;
+    DHCPShard *shard;
+
+    DHCPRangeEnter(srvPtr);
+    range = DHCPRangeFindFast(srvPtr, ipaddr);
+    if (range != NULL) {
+        shard = DHCPShardGet(range, ipaddr);
+        Ns_MutexLock(&shard->lock);
+        DHCPLeaseFree(range, ipaddr);
+        DHCPJournalWrite(srvPtr, JOURNAL_DELETE, ipaddr, NULL, NULL, 0, 0);
+        Ns_MutexUnlock(&shard->lock);
+    }
+    DHCPRangeLeave(srvPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPIndexInit --
+ *
+ *	Setup index stripes of the range, each with its own lock so lookups
+ *      of different clients do not serialize the shards
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPIndexInit(DHCPRange *range)
+{
+    int k;
+
+    for (k = 0; k < INDEX_STRIPES; k++) {
+        Tcl_InitHashTable(&range->index[k].macaddrs, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&range->index[k].clientids, TCL_STRING_KEYS);
+    }
+}
+
+/* FNV-1a of the key selects the stripe */
+static DHCPIndex *DHCPIndexGet(DHCPRange *range, const char *key)
+{
+    u_int32_t hash = 2166136261U;
+
+    while (*key) {
+        hash = (hash ^ (u_int8_t)*key++) * 16777619U;
+    }
+    return &range->index[hash % INDEX_STRIPES];
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPIndexSet --
+ *
+ *	Register lease MAC address and client identifier in the range
+ *      index, so the lease can be found without scanning the range.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Previous mapping for the same MAC or client id in this range is
+ *      replaced
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPIndexSet(DHCPRange *range, u_int32_t ipaddr, char *macaddr, char *clientid)
+{
+    int n;
+    DHCPIndex *index;
+    Tcl_HashEntry *entry;
+
+    if (macaddr != NULL && *macaddr) {
+        index = DHCPIndexGet(range, macaddr);
+        Ns_MutexLock(&index->lock);
+        entry = Tcl_CreateHashEntry(&index->macaddrs, macaddr, &n);
+        Tcl_SetHashValue(entry, (ClientData)(long)ipaddr);
+        Ns_MutexUnlock(&index->lock);
+    }
+    if (clientid != NULL && *clientid) {
+        index = DHCPIndexGet(range, clientid);
+        Ns_MutexLock(&index->lock);
+        entry = Tcl_CreateHashEntry(&index->clientids, clientid, &n);
+        Tcl_SetHashValue(entry, (ClientData)(long)ipaddr);
+        Ns_MutexUnlock(&index->lock);
+    }
+}
+
+static void DHCPIndexUnset(DHCPRange *range, u_int32_t ipaddr, char *macaddr, char *clientid)
+{
+    DHCPIndex *index;
+    Tcl_HashEntry *entry;
+
+    if (macaddr != NULL && *macaddr) {
+        index = DHCPIndexGet(range, macaddr);
+        Ns_MutexLock(&index->lock);
+        entry = Tcl_FindHashEntry(&index->macaddrs, macaddr);
+        if (entry != NULL && (u_int32_t)(long)Tcl_GetHashValue(entry) == ipaddr) {
+            Tcl_DeleteHashEntry(entry);
+        }
+        Ns_MutexUnlock(&index->lock);
+    }
+    if (clientid != NULL && *clientid) {
+        index = DHCPIndexGet(range, clientid);
+        Ns_MutexLock(&index->lock);
+        entry = Tcl_FindHashEntry(&index->clientids, clientid);
+        if (entry != NULL && (u_int32_t)(long)Tcl_GetHashValue(entry) == ipaddr) {
+            Tcl_DeleteHashEntry(entry);
+        }
+        Ns_MutexUnlock(&index->lock);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPIndexFind --
+ *
+ *	Resolve client identifier or MAC address into address leased in
+ *      the range, client identifier takes precedence as per RFC 2131.
+ *
+ * Results:
+ *	ip address or 0 if not found
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static u_int32_t DHCPIndexFind(DHCPRange *range, char *macaddr, char *clientid)
+{
+    u_int32_t ipaddr = 0;
+    DHCPIndex *index;
+    Tcl_HashEntry *entry;
+
+    if (clientid != NULL && *clientid) {
+        index = DHCPIndexGet(range, clientid);
+        Ns_MutexLock(&index->lock);
+        entry = Tcl_FindHashEntry(&index->clientids, clientid);
+        if (entry != NULL) {
+            ipaddr = (u_int32_t)(long)Tcl_GetHashValue(entry);
+        }
+        Ns_MutexUnlock(&index->lock);
+    }
+    if (ipaddr == 0 && macaddr != NULL && *macaddr) {
+        index = DHCPIndexGet(range, macaddr);
+        Ns_MutexLock(&index->lock);
+        entry = Tcl_FindHashEntry(&index->macaddrs, macaddr);
+        if (entry != NULL) {
+            ipaddr = (u_int32_t)(long)Tcl_GetHashValue(entry);
+        }
+        Ns_MutexUnlock(&index->lock);
+    }
+    return ipaddr;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPExpireSchedule --
+ *
+ *	Put lease expiration timer into the timer wheel. Timers are not
+ *      cancelled or moved when lease is renewed or deleted, instead they
+ *      are checked against the lease when they fire.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPExpireSchedule(DHCPServer *srvPtr, u_int32_t ipaddr, u_int32_t expires)
+{
+    DHCPTimer *timer;
+
+    timer = (DHCPTimer*)ns_malloc(sizeof(DHCPTimer));
+    timer->ipaddr = ipaddr;
+    timer->expires = expires;
+    Ns_MutexLock(&srvPtr->expire.lock);
+    DHCPExpireAdd(srvPtr, timer);
+    Ns_MutexUnlock(&srvPtr->expire.lock);
+}
+
+/* Place timer into the wheel level by its distance from now, expire lock must be held */
+static void DHCPExpireAdd(DHCPServer *srvPtr, DHCPTimer *timer)
+{
+    int level;
+    u_int32_t slot, expires = timer->expires, idx;
+
+    if ((int32_t)(expires - srvPtr->expire.now) < 0) {
+        expires = srvPtr->expire.now;
+    }
+    idx = expires - srvPtr->expire.now;
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (idx < (1U << (WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    if (level == WHEEL_LEVELS - 1 && idx >= (1U << (WHEEL_BITS * WHEEL_LEVELS))) {
+        expires = srvPtr->expire.now + (1U << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    }
+    slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timer->next = srvPtr->expire.wheel[level][slot];
+    srvPtr->expire.wheel[level][slot] = timer;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPExpireCollect --
+ *
+ *	Advance the wheel up to the given time, cascading timers from the
+ *      upper levels as lower levels wrap around.
+ *
+ * Results:
+ *	List of fired timers
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPTimer *DHCPExpireCollect(DHCPServer *srvPtr, u_int32_t now)
+{
+    int level;
+    u_int32_t slot;
+    DHCPTimer *timer, *next, *list = NULL;
+
+    Ns_MutexLock(&srvPtr->expire.lock);
+    while ((int32_t)(now - srvPtr->expire.now) >= 0) {
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if ((srvPtr->expire.now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) {
+                break;
+            }
+            slot = (srvPtr->expire.now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            timer = srvPtr->expire.wheel[level][slot];
+            srvPtr->expire.wheel[level][slot] = NULL;
+            while (timer != NULL) {
+                next = timer->next;
+                DHCPExpireAdd(srvPtr, timer);
+                timer = next;
+            }
+        }
+        slot = srvPtr->expire.now & WHEEL_MASK;
+        timer = srvPtr->expire.wheel[0][slot];
+        srvPtr->expire.wheel[0][slot] = NULL;
+        while (timer != NULL) {
+            next = timer->next;
+            timer->next = list;
+            list = timer;
+            timer = next;
+        }
+        srvPtr->expire.now++;
+    }
+    Ns_MutexUnlock(&srvPtr->expire.lock);
+    return list;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPExpireAppend --
+ *
+ *	Add expired lease to the batch passed to expire_proc
+ *
+ * Results:
+ *	1 if the batch is full and should be flushed
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPExpireAppend(DHCPExpireBatch *batch, DHCPLease *lease, char *clientid)
+{
+    int i;
+    char buf[32];
+    Tcl_Obj *obj;
+
+    if (batch->srvPtr->debug > 1) {
+        Ns_Log(Notice, "LeaseExpire: %s %s", addr2str(lease->ipaddr), lease->macaddr);
+    }
+    for (i = 0; i < batch->srvPtr->plugins.count; i++) {
+        Ns_DhcpPlugin *plugin = &batch->srvPtr->plugins.list[i];
+        if (plugin->expire != NULL) {
+            (*plugin->expire)(plugin->arg, lease->ipaddr, lease->macaddr, clientid);
+        }
+    }
+    if (batch->srvPtr->expire.proc == NULL) {
+        return 0;
+    }
+    if (batch->list == NULL) {
+        batch->list = Tcl_NewListObj(0, NULL);
+        Tcl_IncrRefCount(batch->list);
+    }
+    obj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, obj, Tcl_NewStringObj(addr2str(lease->ipaddr), -1));
+    Tcl_ListObjAppendElement(NULL, obj, Tcl_NewStringObj(lease->macaddr, -1));
+    Tcl_ListObjAppendElement(NULL, obj, Tcl_NewStringObj(clientid ? clientid : "", -1));
+    sprintf(buf, "%u", lease->lease_time);
+    Tcl_ListObjAppendElement(NULL, obj, Tcl_NewStringObj(buf, -1));
+    sprintf(buf, "%u", lease->expires);
+    Tcl_ListObjAppendElement(NULL, obj, Tcl_NewStringObj(buf, -1));
+    Tcl_ListObjAppendElement(NULL, batch->list, obj);
+    return ++batch->count >= batch->srvPtr->expire.batch;
+}
+
+/* Call expire_proc with collected leases, must be called without shard locks */
+static void DHCPExpireFlush(DHCPExpireBatch *batch)
+{
+    Tcl_Obj *obj;
+
+    if (batch->list == NULL) {
+        return;
+    }
+    if (batch->interp == NULL) {
+        batch->interp = Ns_TclAllocateInterp(batch->srvPtr->name);
+    }
+    if (batch->interp != NULL) {
+        obj = Tcl_NewStringObj(batch->srvPtr->expire.proc, -1);
+        Tcl_IncrRefCount(obj);
+        Tcl_ListObjAppendElement(NULL, obj, batch->list);
+        if (Tcl_EvalObjEx(batch->interp, obj, 0) != TCL_OK) {
+            Ns_TclLogError(batch->interp);
+        }
+        Tcl_DecrRefCount(obj);
+    }
+    Tcl_DecrRefCount(batch->list);
+    batch->list = NULL;
+    batch->count = 0;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPExpireProcess --
+ *
+ *	Check fired timers against the leases: stale timers are dropped,
+ *      timers of renewed leases are rescheduled and expired leases are
+ *      deleted. Shard lock is kept while consecutive timers belong to the
+ *      same shard.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Expired leases are added to the expire_proc batch
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPExpireProcess(DHCPExpireBatch *batch, DHCPTimer *timers, u_int32_t now)
+{
+    int full = 0;
+    DHCPLease *lease;
+    DHCPTimer *timer;
+    Tcl_HashEntry *entry;
+    DHCPRange *range = NULL;
+    DHCPShard *shard = NULL;
+    DHCPServer *srvPtr = batch->srvPtr;
+
+    while (timers != NULL) {
+        timer = timers;
+        timers = timer->next;
+
+        if (shard == NULL || ntohl(timer->ipaddr) < shard->start || ntohl(timer->ipaddr) > shard->end) {
+            if (shard != NULL) {
+                Ns_MutexUnlock(&shard->lock);
+            }
+            range = DHCPRangeFindFast(srvPtr, timer->ipaddr);
+            shard = range != NULL ? DHCPShardGet(range, timer->ipaddr) : NULL;
+            if (shard != NULL) {
+                Ns_MutexLock(&shard->lock);
+            }
+        }
+        entry = shard && !range->records ? Tcl_FindHashEntry(&shard->leases, (char*)timer->ipaddr) : NULL;
+        lease = entry ? (DHCPLease*)Tcl_GetHashValue(entry) : NULL;
+
+        if (lease == NULL || lease->scheduled != timer->expires) {
+            ns_free(timer);
+
+        } else
+        if ((int32_t)(lease->expires - now) > 0) {
+            lease->scheduled = timer->expires = lease->expires;
+            Ns_MutexLock(&srvPtr->expire.lock);
+            DHCPExpireAdd(srvPtr, timer);
+            Ns_MutexUnlock(&srvPtr->expire.lock);
+
+        } else {
+            ns_free(timer);
+            full = DHCPExpireAppend(batch, lease, lease->clientid);
+            DHCPLeaseFree(range, lease->ipaddr);
+        }
+        if (full) {
+            if (shard != NULL) {
+                Ns_MutexUnlock(&shard->lock);
+                shard = NULL;
+            }
+            DHCPExpireFlush(batch);
+            full = 0;
+        }
+    }
+    if (shard != NULL) {
+        Ns_MutexUnlock(&shard->lock);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPExpireSweep --
+ *
+ *	Walk the lease array of a dense range and delete expired leases
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Expired leases are added to the expire_proc batch
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPExpireSweep(DHCPExpireBatch *batch, DHCPRange *range, u_int32_t now)
+{
+    int k, full;
+    u_int32_t i;
+    DHCPShard *shard;
+    DHCPLease lease;
+    DHCPLeaseRecord *rec;
+    Tcl_HashEntry *entry;
+
+    for (k = 0; k < range->nshards; k++) {
+        shard = &range->shards[k];
+        Ns_MutexLock(&shard->lock);
+        for (i = shard->start; i <= shard->end; i++) {
+            rec = &range->records[i - range->start];
+            if (rec->state != LEASE_ACTIVE || (int32_t)(rec->expires - now) > 0) {
+                continue;
+            }
+            lease.ipaddr = htonl(i);
+            lease.expires = rec->expires;
+            lease.lease_time = rec->lease_time;
+            lease.macaddr[0] = 0;
+            if (rec->flags & LEASE_MACADDR) {
+                bin2str(lease.macaddr, rec->macaddr, 6);
+            }
+            entry = Tcl_FindHashEntry(&shard->clientids, (char*)lease.ipaddr);
+            full = DHCPExpireAppend(batch, &lease, entry ? Tcl_GetHashValue(entry) : NULL);
+            DHCPLeaseFree(range, lease.ipaddr);
+            if (full) {
+                Ns_MutexUnlock(&shard->lock);
+                DHCPExpireFlush(batch);
+                Ns_MutexLock(&shard->lock);
+            }
+        }
+        Ns_MutexUnlock(&shard->lock);
+    }
+}
+
+static void DHCPExpireThread(void *arg)
+{
+    int i;
+    Ns_Time timeout;
+    u_int32_t now;
+    DHCPTimer *timers;
+    DHCPRangeTable *table;
+    DHCPExpireBatch batch;
+    DHCPServer *srvPtr = (DHCPServer*)arg;
+
+    Ns_ThreadSetName("-nsdhcpd:expire-");
+    Ns_Log(Notice, "nsdhcpd: expire thread started, interval %d", srvPtr->expire.interval);
+
+    memset(&batch, 0, sizeof(batch));
+    batch.srvPtr = srvPtr;
+
+    Ns_MutexLock(&srvPtr->expire.lock);
+    while (!srvPtr->expire.shutdown) {
+        Ns_GetTime(&timeout);
+        Ns_IncrTime(&timeout, srvPtr->expire.interval, 0);
+        Ns_CondTimedWait(&srvPtr->expire.cond, &srvPtr->expire.lock, &timeout);
+        if (srvPtr->expire.shutdown) {
+            break;
+        }
+        Ns_MutexUnlock(&srvPtr->expire.lock);
+        now = time(0);
+        table = DHCPRangeEnter(srvPtr);
+        timers = DHCPExpireCollect(srvPtr, now);
+        if (timers != NULL) {
+            DHCPExpireProcess(&batch, timers, now);
+        }
+        for (i = 0; i < table->count; i++) {
+            if (table->items[i]->records != NULL) {
+                DHCPExpireSweep(&batch, table->items[i], now);
+            }
+        }
+        DHCPExpireFlush(&batch);
+        DHCPRangeLeave(srvPtr);
+        if (batch.interp != NULL) {
+            Ns_TclDeAllocateInterp(batch.interp);
+            batch.interp = NULL;
+        }
+        Ns_MutexLock(&srvPtr->expire.lock);
+    }
+    srvPtr->expire.stopped = 1;
+    Ns_CondBroadcast(&srvPtr->expire.cond);
+    Ns_MutexUnlock(&srvPtr->expire.lock);
+    Ns_Log(Notice, "nsdhcpd: expire thread stopped");
+}
+
+static void DHCPExpireShutdown(const Ns_Time *toPtr, void *arg)
+{
+    DHCPServer *srvPtr = (DHCPServer*)arg;
+
+    Ns_MutexLock(&srvPtr->expire.lock);
+    if (toPtr == NULL) {
+        srvPtr->expire.shutdown = 1;
+        Ns_CondBroadcast(&srvPtr->expire.cond);
+    } else {
+        while (!srvPtr->expire.stopped) {
+            if (Ns_CondTimedWait(&srvPtr->expire.cond, &srvPtr->expire.lock, toPtr) != NS_OK) {
+                break;
+            }
+        }
+    }
+    Ns_MutexUnlock(&srvPtr->expire.lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPJournalInit --
+ *
+ *	Replay existing lease journal into the pending list, leases are
+ *      moved into ranges when they are created by rangeadd. The journal
+ *      is rewritten right away so torn records from a crash are dropped.
+ *      Compacted journal holds every lease, so it wins over the snapshot:
+ *      snapshot records are only used as the initial state when there is
+ *      no journal yet, otherwise deleted or shortened leases would come
+ *      back from an older snapshot.
+ *
+ * Results:
+ *	NS_OK or NS_ERROR
+ *
+ * Side effects:
+ *  	Journal file is opened for appending
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPJournalInit(DHCPServer *srvPtr)
+{
+    int fd, n, size = 0, count = 0;
+    char magic[sizeof(JOURNAL_MAGIC) - 1];
+    char clientid[512];
+    Tcl_HashTable leases;
+    Tcl_HashEntry *entry;
+    Tcl_HashSearch search;
+    DHCPJournalRecord rec;
+    DHCPJournalEntry *pending;
+    u_int32_t now = time(0);
+
+    Tcl_InitHashTable(&leases, TCL_ONE_WORD_KEYS);
+
+    fd = open(srvPtr->journal.path, O_RDONLY);
+    if (fd >= 0) {
+        if (read(fd, magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, JOURNAL_MAGIC, sizeof(magic))) {
+            Ns_Log(Error, "nsdhcpd: %s: not a lease journal", srvPtr->journal.path);
+            close(fd);
+            Tcl_DeleteHashTable(&leases);
+            return NS_ERROR;
+        }
+        while (read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+            if (rec.idlen >= sizeof(clientid) || read(fd, clientid, rec.idlen) != rec.idlen) {
+                break;
+            }
+            clientid[rec.idlen] = 0;
+            if (DHCPJournalChecksum(&rec, clientid) != rec.checksum) {
+                Ns_Log(Warning, "nsdhcpd: %s: bad record after %d records, rest is ignored", srvPtr->journal.path, count);
+                break;
+            }
+            count++;
+            switch (rec.type) {
+            case JOURNAL_CREATE:
+                entry = Tcl_CreateHashEntry(&leases, (char*)(long)rec.ipaddr, &n);
+                if (!n) {
+                    ns_free(((DHCPJournalEntry*)Tcl_GetHashValue(entry))->clientid);
+                    ns_free(Tcl_GetHashValue(entry));
+                }
+                pending = ns_calloc(1, sizeof(DHCPJournalEntry));
+                pending->rec = rec;
+                pending->clientid = rec.idlen ? ns_strdup(clientid) : NULL;
+                Tcl_SetHashValue(entry, pending);
+                break;
+
+            case JOURNAL_RENEW:
+                entry = Tcl_FindHashEntry(&leases, (char*)(long)rec.ipaddr);
+                if (entry != NULL) {
+                    ((DHCPJournalEntry*)Tcl_GetHashValue(entry))->rec.expires = rec.expires;
+                }
+                break;
+
+            case JOURNAL_DELETE:
+                entry = Tcl_FindHashEntry(&leases, (char*)(long)rec.ipaddr);
+                if (entry != NULL) {
+                    ns_free(((DHCPJournalEntry*)Tcl_GetHashValue(entry))->clientid);
+                    ns_free(Tcl_GetHashValue(entry));
+                    Tcl_DeleteHashEntry(entry);
+                }
+                break;
+            }
+        }
+        close(fd);
+
+    } else
+    if (errno == ENOENT) {
+        u_int32_t i;
+        DHCPSnapshotRecord *srec;
+        DHCPSnapshot *snap = &srvPtr->snapshot.map;
+
+        for (i = 0; i < snap->count; i++) {
+            srec = &snap->records[i];
+            if (srec->idoff >= snap->strsize) {
+                continue;
+            }
+            memset(&rec, 0, sizeof(rec));
+            rec.type = JOURNAL_CREATE;
+            rec.ipaddr = srec->ipaddr;
+            rec.expires = srec->expires;
+            rec.lease_time = srec->lease_time;
+            rec.flags = srec->flags;
+            memcpy(rec.macaddr, srec->macaddr, sizeof(rec.macaddr));
+            pending = ns_calloc(1, sizeof(DHCPJournalEntry));
+            if (srec->idoff && strlen(snap->strings + srec->idoff) < sizeof(clientid)) {
+                pending->clientid = ns_strdup(snap->strings + srec->idoff);
+                rec.idlen = strlen(pending->clientid);
+            }
+            rec.checksum = DHCPJournalChecksum(&rec, pending->clientid);
+            pending->rec = rec;
+            entry = Tcl_CreateHashEntry(&leases, (char*)(long)rec.ipaddr, &n);
+            Tcl_SetHashValue(entry, pending);
+        }
+        if (snap->count > 0) {
+            Ns_Log(Notice, "nsdhcpd: %s: no journal, starting from %u snapshot leases", srvPtr->journal.path, snap->count);
+        }
+    }
+
+    /*
+     * Snapshot leases are part of the replayed state now
+     */
+
+    DHCPSnapshotClose(&srvPtr->snapshot.map);
+
+    /*
+     * Keep only valid leases sorted by address, so rangeadd can find its
+     * part with binary search
+     */
+
+    srvPtr->journal.pending = ns_calloc(leases.numEntries + 1, sizeof(DHCPJournalEntry));
+    entry = Tcl_FirstHashEntry(&leases, &search);
+    while (entry != NULL) {
+        pending = (DHCPJournalEntry*)Tcl_GetHashValue(entry);
+        if ((int32_t)(pending->rec.expires - now) > 0) {
+            srvPtr->journal.pending[size++] = *pending;
+        } else {
+            ns_free(pending->clientid);
+        }
+        ns_free(pending);
+        entry = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(&leases);
+    srvPtr->journal.npending = size;
+    qsort(srvPtr->journal.pending, size, sizeof(DHCPJournalEntry), DHCPJournalCmp);
+    Ns_Log(Notice, "nsdhcpd: %s: replayed %d records, %d active leases", srvPtr->journal.path, count, size);
+
+    srvPtr->journal.fd = -1;
+    return DHCPJournalCompact(srvPtr);
+}
+
+static int DHCPJournalCmp(const void *a, const void *b)
+{
+    u_int32_t ip1 = ntohl(((DHCPJournalEntry*)a)->rec.ipaddr);
+    u_int32_t ip2 = ntohl(((DHCPJournalEntry*)b)->rec.ipaddr);
+
+    return ip1 < ip2 ? -1 : ip1 > ip2 ? 1 : 0;
+}
+
+/* FNV-1a over the record without the checksum field and the client id */
+static u_int32_t DHCPJournalChecksum(DHCPJournalRecord *rec, char *clientid)
+{
+    int i;
+    u_int8_t *ptr = (u_int8_t*)rec + sizeof(rec->checksum);
+    u_int32_t hash = 2166136261U;
+
+    for (i = sizeof(rec->checksum); i < sizeof(DHCPJournalRecord); i++) {
+        hash = (hash ^ *ptr++) * 16777619U;
+    }
+    for (i = 0; i < rec->idlen; i++) {
+        hash = (hash ^ (u_int8_t)clientid[i]) * 16777619U;
+    }
+    return hash;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPJournalEncode --
+ *
+ *	Append binary journal record to the buffer
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPJournalEncode(Ns_DString *ds, u_int8_t type, DHCPLease *lease, char *clientid)
+{
+    DHCPJournalRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.ipaddr = lease->ipaddr;
+    rec.expires = lease->expires;
+    rec.lease_time = lease->lease_time;
+    if (lease->macaddr[0]) {
+        hex2bin(rec.macaddr, lease->macaddr, 6);
+        rec.flags |= LEASE_MACADDR;
+    }
+    if (clientid != NULL) {
+        rec.idlen = strlen(clientid);
+    }
+    rec.checksum = DHCPJournalChecksum(&rec, clientid);
+    Ns_DStringNAppend(ds, (char*)&rec, sizeof(rec));
+    if (rec.idlen > 0) {
+        Ns_DStringNAppend(ds, clientid, rec.idlen);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPJournalWrite --
+ *
+ *	Queue lease event for the journal writer thread, only memory copy
+ *      is made here so the caller never waits for the disk.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPJournalWrite(DHCPServer *srvPtr, u_int8_t type, u_int32_t ipaddr, char *macaddr, char *clientid, u_int32_t lease_time, u_int32_t expires)
+{
+    DHCPLease lease;
+
+    if (srvPtr->journal.path == NULL) {
+        return;
+    }
+    memset(&lease, 0, sizeof(lease));
+    lease.ipaddr = ipaddr;
+    lease.expires = expires;
+    lease.lease_time = lease_time;
+    if (macaddr != NULL) {
+        strncpy(lease.macaddr, macaddr, 12);
+    }
+    if (clientid != NULL && (!*clientid || strlen(clientid) >= 512)) {
+        clientid = NULL;
+    }
+    Ns_MutexLock(&srvPtr->journal.lock);
+    if (srvPtr->journal.buffer.length == 0) {
+        Ns_CondSignal(&srvPtr->journal.cond);
+    }
+    DHCPJournalEncode(&srvPtr->journal.buffer, type, &lease, clientid);
+    Ns_MutexUnlock(&srvPtr->journal.lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPJournalLoad --
+ *
+ *	Create replayed leases which belong to the new range, range is not
+ *      linked yet so nothing is written back to the journal.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPJournalLoad(DHCPServer *srvPtr, DHCPRange *range)
+{
+    int i, count = 0;
+    char macaddr[13];
+    DHCPJournalEntry *pending;
+
+    /*
+     * Pending entries of this range are only changed by DHCPJournalConsume
+     * for the same range, no journal lock is needed to read them
+     */
+
+    DHCPRangeLock(range);
+    for (i = DHCPJournalFirst(srvPtr, range->start); i < srvPtr->journal.npending; i++) {
+        pending = &srvPtr->journal.pending[i];
+        if (ntohl(pending->rec.ipaddr) > range->end) {
+            break;
+        }
+        if (pending->consumed) {
+            continue;
+        }
+        macaddr[0] = 0;
+        if (pending->rec.flags & LEASE_MACADDR) {
+            bin2str(macaddr, pending->rec.macaddr, 6);
+        }
+        DHCPLeaseCreate(range, pending->rec.ipaddr, macaddr, pending->clientid, pending->rec.lease_time, pending->rec.expires);
+        count++;
+    }
+    DHCPRangeUnlock(range);
+    if (count > 0) {
+        Ns_Log(Notice, "nsdhcpd: %s-%s: %d leases restored from the journal",
+               addr2str(htonl(range->start)), addr2str(htonl(range->end)), count);
+    }
+}
+
+/* Mark replayed leases of the linked range as owned by the range */
+static void DHCPJournalConsume(DHCPServer *srvPtr, DHCPRange *range)
+{
+    int i;
+    DHCPJournalEntry *pending;
+
+    Ns_MutexLock(&srvPtr->journal.lock);
+    for (i = DHCPJournalFirst(srvPtr, range->start); i < srvPtr->journal.npending; i++) {
+        pending = &srvPtr->journal.pending[i];
+        if (ntohl(pending->rec.ipaddr) > range->end) {
+            break;
+        }
+        if (!pending->consumed) {
+            pending->consumed = 1;
+            ns_free(pending->clientid);
+            pending->clientid = NULL;
+        }
+    }
+    Ns_MutexUnlock(&srvPtr->journal.lock);
+}
+
+/* Binary search for the first pending lease with address not less than start */
+static int DHCPJournalFirst(DHCPServer *srvPtr, u_int32_t start)
+{
+    int lo = 0, hi = srvPtr->journal.npending, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ntohl(srvPtr->journal.pending[mid].rec.ipaddr) < start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPJournalCompact --
+ *
+ *	Write all active leases into new journal file and replace the
+ *      current one with atomic rename. Events queued while the snapshot
+ *      is being made are written after it, replaying them again is
+ *      harmless because every record is idempotent.
+ *
+ * Results:
+ *	NS_OK or NS_ERROR
+ *
+ * Side effects:
+ *  	Journal file descriptor is replaced
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPJournalCompact(DHCPServer *srvPtr)
+{
+    int i, k, fd, count = 0;
+    u_int32_t n;
+    DHCPRange *range;
+    DHCPShard *shard;
+    DHCPRangeTable *table;
+    DHCPLease *lease, buf;
+    Tcl_HashSearch search;
+    Tcl_HashEntry *entry;
+    Ns_DString ds, path, clientid;
+
+    Ns_DStringInit(&ds);
+    Ns_DStringInit(&path);
+    Ns_DStringInit(&clientid);
+    Ns_DStringPrintf(&path, "%s.tmp", srvPtr->journal.path);
+    Ns_DStringNAppend(&ds, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC) - 1);
+
+    /*
+     * Pending leases first, then ranges, rangeadd links the range before
+     * marking its pending leases consumed, so no lease can be missed
+     */
+
+    Ns_MutexLock(&srvPtr->journal.lock);
+    for (i = 0; i < srvPtr->journal.npending; i++) {
+        if (!srvPtr->journal.pending[i].consumed) {
+            Ns_DStringNAppend(&ds, (char*)&srvPtr->journal.pending[i].rec, sizeof(DHCPJournalRecord));
+            if (srvPtr->journal.pending[i].rec.idlen > 0) {
+                Ns_DStringNAppend(&ds, srvPtr->journal.pending[i].clientid, srvPtr->journal.pending[i].rec.idlen);
+            }
+            count++;
+        }
+    }
+    Ns_MutexUnlock(&srvPtr->journal.lock);
+
+    table = DHCPRangeEnter(srvPtr);
+    for (i = 0; i < table->count; i++) {
+        range = table->items[i];
+        for (k = 0; k < range->nshards; k++) {
+            shard = &range->shards[k];
+            Ns_MutexLock(&shard->lock);
+            if (range->records != NULL) {
+                for (n = shard->start; n <= shard->end; n++) {
+                    if (range->records[n - range->start].state == LEASE_ACTIVE) {
+                        Ns_DStringSetLength(&clientid, 0);
+                        DHCPLeaseGet(range, htonl(n), &buf, &clientid);
+                        DHCPJournalEncode(&ds, JOURNAL_CREATE, &buf, clientid.length ? clientid.string : NULL);
+                        count++;
+                    }
+                }
+            } else {
+                entry = Tcl_FirstHashEntry(&shard->leases, &search);
+                while (entry != NULL) {
+                    lease = (DHCPLease*)Tcl_GetHashValue(entry);
+                    DHCPJournalEncode(&ds, JOURNAL_CREATE, lease, lease->clientid);
+                    count++;
+                    entry = Tcl_NextHashEntry(&search);
+                }
+            }
+            Ns_MutexUnlock(&shard->lock);
+        }
+    }
+    DHCPRangeLeave(srvPtr);
+
+    fd = open(path.string, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0 || write(fd, ds.string, ds.length) != ds.length || fsync(fd) != 0) {
+        Ns_Log(Error, "nsdhcpd: %s: journal compaction failed: %s", path.string, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(path.string);
+        }
+        fd = -1;
+    } else
+    if (rename(path.string, srvPtr->journal.path) != 0) {
+        Ns_Log(Error, "nsdhcpd: %s: rename failed: %s", path.string, strerror(errno));
+        close(fd);
+        unlink(path.string);
+        fd = -1;
+    } else {
+        close(fd);
+        fd = open(srvPtr->journal.path, O_WRONLY|O_APPEND);
+    }
+    Ns_DStringFree(&ds);
+    Ns_DStringFree(&path);
+    Ns_DStringFree(&clientid);
+
+    if (fd < 0) {
+        return NS_ERROR;
+    }
+    if (srvPtr->journal.fd >= 0) {
+        close(srvPtr->journal.fd);
+    }
+    srvPtr->journal.fd = fd;
+    srvPtr->journal.compacted = time(0);
+    if (srvPtr->debug > 0) {
+        Ns_Log(Notice, "nsdhcpd: %s: compacted, %d leases", srvPtr->journal.path, count);
+    }
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPJournalThread --
+ *
+ *	Journal writer, everything queued while previous batch was being
+ *      written and synced goes to disk with one write and one fsync.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPJournalThread(void *arg)
+{
+    Ns_Time timeout;
+    Ns_DString ds;
+    DHCPServer *srvPtr = (DHCPServer*)arg;
+
+    Ns_ThreadSetName("-nsdhcpd:journal-");
+    Ns_DStringInit(&ds);
+
+    Ns_MutexLock(&srvPtr->journal.lock);
+    while (1) {
+        while (srvPtr->journal.buffer.length == 0 && !srvPtr->journal.shutdown) {
+            Ns_GetTime(&timeout);
+            Ns_IncrTime(&timeout, 1, 0);
+            if (Ns_CondTimedWait(&srvPtr->journal.cond, &srvPtr->journal.lock, &timeout) == NS_TIMEOUT) {
+                break;
+            }
+        }
+        Ns_DStringNAppend(&ds, srvPtr->journal.buffer.string, srvPtr->journal.buffer.length);
+        Ns_DStringSetLength(&srvPtr->journal.buffer, 0);
+        Ns_MutexUnlock(&srvPtr->journal.lock);
+
+        if (ds.length > 0 && srvPtr->journal.fd >= 0) {
+            if (write(srvPtr->journal.fd, ds.string, ds.length) != ds.length || fsync(srvPtr->journal.fd) != 0) {
+                Ns_Log(Error, "nsdhcpd: %s: journal write error: %s", srvPtr->journal.path, strerror(errno));
+            }
+        }
+        Ns_DStringSetLength(&ds, 0);
+
+        if (srvPtr->journal.shutdown) {
+            break;
+        }
+        if (time(0) - srvPtr->journal.compacted >= srvPtr->journal.compact) {
+            DHCPJournalCompact(srvPtr);
+        }
+        Ns_MutexLock(&srvPtr->journal.lock);
+    }
+    Ns_DStringFree(&ds);
+
+    Ns_MutexLock(&srvPtr->journal.lock);
+    if (srvPtr->journal.fd >= 0) {
+        close(srvPtr->journal.fd);
+        srvPtr->journal.fd = -1;
+    }
+    srvPtr->journal.stopped = 1;
+    Ns_CondBroadcast(&srvPtr->journal.cond);
+    Ns_MutexUnlock(&srvPtr->journal.lock);
+    Ns_Log(Notice, "nsdhcpd: journal thread stopped");
+}
+
+static void DHCPJournalShutdown(const Ns_Time *toPtr, void *arg)
+{
+    DHCPServer *srvPtr = (DHCPServer*)arg;
+
+    Ns_MutexLock(&srvPtr->journal.lock);
+    if (toPtr == NULL) {
+        srvPtr->journal.shutdown = 1;
+        Ns_CondBroadcast(&srvPtr->journal.cond);
+    } else {
+        while (!srvPtr->journal.stopped) {
+            if (Ns_CondTimedWait(&srvPtr->journal.cond, &srvPtr->journal.lock, toPtr) != NS_OK) {
+                break;
+            }
+        }
+    }
+    Ns_MutexUnlock(&srvPtr->journal.lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPSnapshotOpen --
+ *
+ *	Map lease snapshot file into memory and verify its header
+ *
+ * Results:
+ *	NS_OK or NS_ERROR
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPSnapshotOpen(char *path, DHCPSnapshot *snap)
+{
+    int fd;
+    struct stat st;
+    DHCPSnapshotHeader *hdr;
+
+    memset(snap, 0, sizeof(DHCPSnapshot));
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NS_ERROR;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < sizeof(DHCPSnapshotHeader)) {
+        close(fd);
+        Ns_Log(Error, "nsdhcpd: %s: snapshot is too short", path);
+        return NS_ERROR;
+    }
+    snap->size = st.st_size;
+    snap->addr = mmap(NULL, snap->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snap->addr == MAP_FAILED) {
+        Ns_Log(Error, "nsdhcpd: %s: mmap failed: %s", path, strerror(errno));
+        snap->addr = NULL;
+        return NS_ERROR;
+    }
+    hdr = (DHCPSnapshotHeader*)snap->addr;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != SNAPSHOT_VERSION ||
+        hdr->recsize != sizeof(DHCPSnapshotRecord) ||
+        sizeof(DHCPSnapshotHeader) + (size_t)hdr->count * sizeof(DHCPSnapshotRecord) + hdr->strsize != snap->size) {
+        Ns_Log(Error, "nsdhcpd: %s: invalid snapshot header", path);
+        DHCPSnapshotClose(snap);
+        return NS_ERROR;
+    }
+    snap->count = hdr->count;
+    snap->records = (DHCPSnapshotRecord*)(hdr + 1);
+    snap->strings = (char*)(snap->records + snap->count);
+    snap->strsize = hdr->strsize;
+    if (snap->strsize == 0 || snap->strings[snap->strsize - 1] != 0) {
+        Ns_Log(Error, "nsdhcpd: %s: invalid snapshot string area", path);
+        DHCPSnapshotClose(snap);
+        return NS_ERROR;
+    }
+    return NS_OK;
+}
+
+static void DHCPSnapshotClose(DHCPSnapshot *snap)
+{
+    if (snap->addr != NULL) {
+        munmap(snap->addr, snap->size);
+    }
+    memset(snap, 0, sizeof(DHCPSnapshot));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPSnapshotLoad --
+ *
+ *	Create leases from the mapped snapshot, records are sorted by
+ *      address so only the part that belongs to the range is visited.
+ *      Without range all records are loaded into existing ranges.
+ *
+ * Results:
+ *	Number of created leases
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPSnapshotLoad(DHCPServer *srvPtr, DHCPSnapshot *snap, DHCPRange *range)
+{
+    char macaddr[13];
+    DHCPRange *locked = NULL;
+    DHCPShard *shard = NULL;
+    DHCPSnapshotRecord *rec;
+    u_int32_t i = 0, lo, hi, mid, now = time(0);
+    int count = 0;
+
+    if (range != NULL) {
+        lo = 0;
+        hi = snap->count;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (ntohl(snap->records[mid].ipaddr) < range->start) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        i = lo;
+        locked = range;
+        DHCPRangeLock(range);
+    } else {
+        DHCPRangeEnter(srvPtr);
+    }
+    for (; i < snap->count; i++) {
+        rec = &snap->records[i];
+        if (range != NULL) {
+            if (ntohl(rec->ipaddr) > range->end) {
+                break;
+            }
+        } else
+        if (shard == NULL || ntohl(rec->ipaddr) < shard->start || ntohl(rec->ipaddr) > shard->end) {
+            if (shard != NULL) {
+                Ns_MutexUnlock(&shard->lock);
+            }
+            locked = DHCPRangeFindFast(srvPtr, rec->ipaddr);
+            shard = locked != NULL ? DHCPShardGet(locked, rec->ipaddr) : NULL;
+            if (shard == NULL) {
+                continue;
+            }
+            Ns_MutexLock(&shard->lock);
+        }
+        if ((int32_t)(rec->expires - now) <= 0 || rec->idoff >= snap->strsize) {
+            continue;
+        }
+        macaddr[0] = 0;
+        if (rec->flags & LEASE_MACADDR) {
+            bin2str(macaddr, rec->macaddr, 6);
+        }
+        DHCPLeaseCreate(locked, rec->ipaddr, macaddr, rec->idoff ? snap->strings + rec->idoff : NULL,
+                        rec->lease_time, rec->expires);
+        count++;
+    }
+    if (range != NULL) {
+        DHCPRangeUnlock(range);
+    } else {
+        if (shard != NULL) {
+            Ns_MutexUnlock(&shard->lock);
+        }
+        DHCPRangeLeave(srvPtr);
+    }
+    return count;
+}
+
+static int DHCPSnapshotCmp(const void *a, const void *b)
+{
+    u_int32_t ip1 = ntohl(((DHCPSnapshotRecord*)a)->ipaddr);
+    u_int32_t ip2 = ntohl(((DHCPSnapshotRecord*)b)->ipaddr);
+
+    return ip1 < ip2 ? -1 : ip1 > ip2 ? 1 : 0;
+}
+
+/* Append one snapshot record, client id goes into the string area */
+static void DHCPSnapshotAppend(Ns_DString *records, Ns_DString *strings, DHCPLease *lease, char *clientid)
+{
+    DHCPSnapshotRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.ipaddr = lease->ipaddr;
+    rec.expires = lease->expires;
+    rec.lease_time = lease->lease_time;
+    if (lease->macaddr[0]) {
+        hex2bin(rec.macaddr, lease->macaddr, 6);
+        rec.flags |= LEASE_MACADDR;
+    }
+    if (clientid != NULL && *clientid) {
+        rec.idoff = strings->length;
+        Ns_DStringNAppend(strings, clientid, strlen(clientid) + 1);
+    }
+    Ns_DStringNAppend(records, (char*)&rec, sizeof(rec));
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPSnapshotSave --
+ *
+ *	Write all leases into snapshot file, the file is written under
+ *      temporary name and renamed so readers never see partial snapshot.
+ *
+ * Results:
+ *	Number of saved leases or -1 on error
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPSnapshotSave(DHCPServer *srvPtr, char *path)
+{
+    int i, k, fd, rc = -1;
+    u_int32_t n;
+    DHCPRange *range;
+    DHCPShard *shard;
+    DHCPRangeTable *table;
+    DHCPLease *lease, buf;
+    DHCPSnapshotHeader hdr;
+    Tcl_HashSearch search;
+    Tcl_HashEntry *entry;
+    Ns_DString records, strings, tmp, clientid;
+
+    Ns_DStringInit(&records);
+    Ns_DStringInit(&strings);
+    Ns_DStringInit(&clientid);
+    Ns_DStringInit(&tmp);
+    Ns_DStringNAppend(&strings, "", 1);
+
+    table = DHCPRangeEnter(srvPtr);
+    for (i = 0; i < table->count; i++) {
+        range = table->items[i];
+        for (k = 0; k < range->nshards; k++) {
+            shard = &range->shards[k];
+            Ns_MutexLock(&shard->lock);
+            if (range->records != NULL) {
+                for (n = shard->start; n <= shard->end; n++) {
+                    if (range->records[n - range->start].state == LEASE_ACTIVE) {
+                        Ns_DStringSetLength(&clientid, 0);
+                        DHCPLeaseGet(range, htonl(n), &buf, &clientid);
+                        DHCPSnapshotAppend(&records, &strings, &buf, clientid.string);
+                    }
+                }
+            } else {
+                entry = Tcl_FirstHashEntry(&shard->leases, &search);
+                while (entry != NULL) {
+                    lease = (DHCPLease*)Tcl_GetHashValue(entry);
+                    DHCPSnapshotAppend(&records, &strings, lease, lease->clientid);
+                    entry = Tcl_NextHashEntry(&search);
+                }
+            }
+            Ns_MutexUnlock(&shard->lock);
+        }
+    }
+    DHCPRangeLeave(srvPtr);
+    n = records.length / sizeof(DHCPSnapshotRecord);
+    qsort(records.string, n, sizeof(DHCPSnapshotRecord), DHCPSnapshotCmp);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.recsize = sizeof(DHCPSnapshotRecord);
+    hdr.count = n;
+    hdr.strsize = strings.length;
+    hdr.created = time(0);
+
+    Ns_DStringPrintf(&tmp, "%s.tmp", path);
+    fd = open(tmp.string, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0 ||
+        write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        write(fd, records.string, records.length) != records.length ||
+        write(fd, strings.string, strings.length) != strings.length ||
+        fsync(fd) != 0) {
+        Ns_Log(Error, "nsdhcpd: %s: snapshot write error: %s", tmp.string, strerror(errno));
+    } else
+    if (rename(tmp.string, path) != 0) {
+        Ns_Log(Error, "nsdhcpd: %s: rename failed: %s", tmp.string, strerror(errno));
+    } else {
+        rc = n;
+    }
+    if (fd >= 0) {
+        close(fd);
+        if (rc < 0) {
+            unlink(tmp.string);
+        }
+    }
+    Ns_DStringFree(&records);
+    Ns_DStringFree(&strings);
+    Ns_DStringFree(&clientid);
+    Ns_DStringFree(&tmp);
+    return rc;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeEnter --
+ *
+ *	Start read section, the range table returned and all ranges and
+ *      range options reachable from it stay valid until DHCPRangeLeave.
+ *      Read sections can be nested and never block writers.
+ *
+ * Results:
+ *	Current range table
+ *
+ * Side effects:
+ *  	Reader slot is allocated on first use by the thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPRangeTable *DHCPRangeEnter(DHCPServer *srvPtr)
+{
+    DHCPReader *reader = Ns_TlsGet(&srvPtr->rcu.tls);
+
+    if (reader == NULL) {
+        Ns_MutexLock(&srvPtr->lock);
+        for (reader = srvPtr->rcu.readers; reader != NULL && reader->inuse; reader = reader->next);
+        if (reader == NULL) {
+            reader = ns_calloc(1, sizeof(DHCPReader));
+            reader->srvPtr = srvPtr;
+            reader->next = srvPtr->rcu.readers;
+            srvPtr->rcu.readers = reader;
+        }
+        reader->inuse = 1;
+        Ns_MutexUnlock(&srvPtr->lock);
+        Ns_TlsSet(&srvPtr->rcu.tls, reader);
+    }
+    if (reader->depth++ == 0) {
+        __atomic_store_n(&reader->epoch, __atomic_load_n(&srvPtr->rcu.epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    }
+    return __atomic_load_n(&srvPtr->ranges, __ATOMIC_SEQ_CST);
+}
+
+static void DHCPRangeLeave(DHCPServer *srvPtr)
+{
+    DHCPReader *reader = Ns_TlsGet(&srvPtr->rcu.tls);
+
+    if (--reader->depth == 0) {
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    }
+}
+
+static void DHCPReaderCleanup(void *arg)
+{
+    DHCPReader *reader = (DHCPReader*)arg;
+
+    Ns_MutexLock(&reader->srvPtr->lock);
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    reader->depth = 0;
+    reader->inuse = 0;
+    Ns_MutexUnlock(&reader->srvPtr->lock);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeRetire --
+ *
+ *	Queue objects replaced by a writer and free every queued object
+ *      no reader can still see: objects retired at epoch E are only
+ *      reachable by readers which entered before E. Must be called with
+ *      srvPtr->lock held, after the new objects have been published.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Memory of old tables, deleted ranges and their leases is freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPRangeRetire(DHCPServer *srvPtr, DHCPRangeTable *table, DHCPRange *range, DHCPRangeOptions *options)
+{
+    u_int64_t epoch, oldest;
+    DHCPReader *reader;
+    DHCPRetired *retired, **prev;
+
+    retired = ns_calloc(1, sizeof(DHCPRetired));
+    retired->table = table;
+    retired->range = range;
+    retired->options = options;
+    retired->epoch = __atomic_add_fetch(&srvPtr->rcu.epoch, 1, __ATOMIC_SEQ_CST);
+    retired->next = srvPtr->rcu.retired;
+    srvPtr->rcu.retired = retired;
+
+    oldest = retired->epoch;
+    for (reader = srvPtr->rcu.readers; reader != NULL; reader = reader->next) {
+        epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    prev = &srvPtr->rcu.retired;
+    while ((retired = *prev) != NULL) {
+        if (retired->epoch <= oldest) {
+            *prev = retired->next;
+            DHCPRangeTableFree(retired->table);
+            DHCPRangeFree(retired->range);
+            DHCPRangeOptionsFree(retired->options);
+            ns_free(retired);
+        } else {
+            prev = &retired->next;
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeSearch --
+ *
+ *	Binary search of the sorted range table, ipaddr is in host byte
+ *      order.
+ *
+ * Results:
+ *	Index of the last range starting at or before ipaddr, -1 if none.
+ *      The caller has to check the end of the range.
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPRangeSearch(DHCPRangeTable *table, u_int32_t ipaddr)
+{
+    int low = 0, high = table->count - 1, mid;
+
+    while (low <= high) {
+        mid = low + (high - low) / 2;
+        if (table->items[mid]->start <= ipaddr) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return high;
+}
+
+static int DHCPRangeTableCmp(const void *a, const void *b)
+{
+    u_int32_t s1 = (*(DHCPRange**)a)->start, s2 = (*(DHCPRange**)b)->start;
+
+    return s1 < s2 ? -1 : s1 > s2 ? 1 : 0;
+}
+
+static int DHCPRangePinCmp(const void *a, const void *b)
+{
+    int rc = strcmp(((DHCPRangePin*)a)->macaddr, ((DHCPRangePin*)b)->macaddr);
+
+    return rc ? rc : DHCPRangeTableCmp(&((DHCPRangePin*)a)->range, &((DHCPRangePin*)b)->range);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeTableCopy --
+ *
+ *	Build new range table from the given one with range add inserted
+ *      and range del removed, pinned MAC addresses are taken from the
+ *      current range options.
+ *
+ * Results:
+ *	New range table
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPRangeTable *DHCPRangeTableCopy(DHCPRangeTable *table, DHCPRange *add, DHCPRange *del)
+{
+    int i;
+    DHCPRange *range;
+    DHCPRangeTable *copy;
+
+    copy = ns_calloc(1, sizeof(DHCPRangeTable));
+    copy->items = ns_malloc((table->count + 1) * sizeof(DHCPRange*));
+    copy->pinned = ns_malloc((table->count + 1) * sizeof(DHCPRangePin));
+    for (i = 0; i < table->count; i++) {
+        if (table->items[i] != del) {
+            copy->items[copy->count++] = table->items[i];
+        }
+    }
+    if (add != NULL) {
+        copy->items[copy->count++] = add;
+        qsort(copy->items, copy->count, sizeof(DHCPRange*), DHCPRangeTableCmp);
+    }
+    for (i = 0; i < copy->count; i++) {
+        range = copy->items[i];
+        if (range->options->macaddr[0]) {
+            strcpy(copy->pinned[copy->npinned].macaddr, range->options->macaddr);
+            copy->pinned[copy->npinned++].range = range;
+        }
+    }
+    qsort(copy->pinned, copy->npinned, sizeof(DHCPRangePin), DHCPRangePinCmp);
+    DHCPRangeTableClasses(copy);
+    return copy;
+}
+
+static void DHCPRangeTableFree(DHCPRangeTable *table)
+{
+    Tcl_HashEntry *hPtr;
+    Tcl_HashSearch search;
+
+    if (table != NULL) {
+        if (table->classes != NULL) {
+            for (hPtr = Tcl_FirstHashEntry(table->classes, &search); hPtr; hPtr = Tcl_NextHashEntry(&search)) {
+                ns_free(Tcl_GetHashValue(hPtr));
+            }
+            Tcl_DeleteHashTable(table->classes);
+            ns_free(table->classes);
+        }
+        ns_free(table->codes);
+        ns_free(table->items);
+        ns_free(table->pinned);
+        ns_free(table);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeLink --
+ *
+ *	Publish new range table with the range added.
+ *
+ * Results:
+ *	NS_ERROR if the range overlaps an existing range.
+ *
+ * Side effects:
+ *  	Range becomes visible to request processing.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPRangeLink(DHCPServer *srvPtr, DHCPRange *range)
+{
+    int i;
+    DHCPRangeTable *table;
+
+    Ns_MutexLock(&srvPtr->lock);
+    table = srvPtr->ranges;
+    i = DHCPRangeSearch(table, range->end);
+    if (i >= 0 && table->items[i]->end >= range->start) {
+        Ns_MutexUnlock(&srvPtr->lock);
+        return NS_ERROR;
     }
-    // Make normal lease time
-    req->reply.lease_time = lease->lease_time;
-    lease->expires = time(0) + lease->lease_time;
+    __atomic_store_n(&srvPtr->ranges, DHCPRangeTableCopy(table, range, NULL), __ATOMIC_SEQ_CST);
+    DHCPRangeRetire(srvPtr, table, NULL, NULL);
+    Ns_MutexUnlock(&srvPtr->lock);
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeUnlink --
+ *
+ *	Publish new range table without the range starting at start, all
+ *      leases of the range are deleted and journaled as deleted, the range
+ *      itself is freed once the last reader is gone.
+ *
+ * Results:
+ *	NS_ERROR if there is no such range
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPRangeUnlink(DHCPServer *srvPtr, u_int32_t start)
+{
+    int i;
+    u_int32_t n;
+    DHCPRange *range;
+    DHCPRangeTable *table;
+    Tcl_HashSearch search;
+    Tcl_HashEntry *entry;
+
+    Ns_MutexLock(&srvPtr->lock);
+    table = srvPtr->ranges;
+    i = DHCPRangeSearch(table, start);
+    if (i < 0 || table->items[i]->start != start) {
+        Ns_MutexUnlock(&srvPtr->lock);
+        return NS_ERROR;
+    }
+    range = table->items[i];
+    __atomic_store_n(&srvPtr->ranges, DHCPRangeTableCopy(table, NULL, range), __ATOMIC_SEQ_CST);
+
+    /*
+     * Requests which found the range before the new table was published
+     * may still try to allocate from it, such leases would be journaled
+     * without a matching delete
+     */
+
+    DHCPRangeLock(range);
+    range->dead = 1;
+    if (range->records != NULL) {
+        for (n = 0; n <= range->end - range->start; n++) {
+            if (range->records[n].state == LEASE_ACTIVE) {
+                DHCPLeaseFree(range, htonl(range->start + n));
+                DHCPJournalWrite(srvPtr, JOURNAL_DELETE, htonl(range->start + n), NULL, NULL, 0, 0);
+            }
+        }
+    } else {
+        for (i = 0; i < range->nshards; i++) {
+            while ((entry = Tcl_FirstHashEntry(&range->shards[i].leases, &search)) != NULL) {
+                n = ((DHCPLease*)Tcl_GetHashValue(entry))->ipaddr;
+                DHCPLeaseFree(range, n);
+                DHCPJournalWrite(srvPtr, JOURNAL_DELETE, n, NULL, NULL, 0, 0);
+            }
+        }
+    }
+    DHCPRangeUnlock(range);
+
+    DHCPRangeRetire(srvPtr, table, range, NULL);
+    Ns_MutexUnlock(&srvPtr->lock);
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeUpdate --
+ *
+ *	Replace options of the range starting at start, options not given
+ *      are copied from the current ones.
+ *
+ * Results:
+ *	NS_ERROR with the interp result set on failure
+ *
+ * Side effects:
+ *  	New range table is published when pinned MAC address changes.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPRangeUpdate(DHCPServer *srvPtr, Tcl_Interp *interp, u_int32_t start, char *check, char *reply, char *macaddr)
+{
+    int i;
+    DHCPRange *range;
+    DHCPRangeTable *table;
+    DHCPRangeOptions *options, *old;
+
+    Ns_MutexLock(&srvPtr->lock);
+    table = srvPtr->ranges;
+    i = DHCPRangeSearch(table, start);
+    if (i < 0 || table->items[i]->start != start) {
+        Ns_MutexUnlock(&srvPtr->lock);
+        Tcl_AppendResult(interp, "range not found", NULL);
+        return NS_ERROR;
+    }
+    range = table->items[i];
+    old = range->options;
+    options = DHCPRangeOptionsCreate(interp, check, reply, macaddr, old);
+    if (options == NULL) {
+        Ns_MutexUnlock(&srvPtr->lock);
+        return NS_ERROR;
+    }
+    __atomic_store_n(&range->options, options, __ATOMIC_SEQ_CST);
+    if (check != NULL || strcmp(options->macaddr, old->macaddr)) {
+        __atomic_store_n(&srvPtr->ranges, DHCPRangeTableCopy(table, NULL, NULL), __ATOMIC_SEQ_CST);
+    } else {
+        table = NULL;
+    }
+    DHCPRangeRetire(srvPtr, table, NULL, old);
+    Ns_MutexUnlock(&srvPtr->lock);
+    return NS_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeOptionsCreate --
+ *
+ *	Parse check and reply option lists and MAC address, missing values
+ *      are copied from base if given.
+ *
+ * Results:
+ *	New options or NULL with the interp result set
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPRangeOptions *DHCPRangeOptionsCreate(Tcl_Interp *interp, char *check, char *reply, char *macaddr, DHCPRangeOptions *base)
+{
+    int i, j, argc;
+    CONST char **argv;
+    char *lists[2];
+    DHCPOption *opt, **head;
+    DHCPRangeOptions *options;
+
+    options = ns_calloc(1, sizeof(DHCPRangeOptions));
+    if (macaddr != NULL) {
+        str2mac(options->macaddr, macaddr);
+    } else
+    if (base != NULL) {
+        strcpy(options->macaddr, base->macaddr);
+    }
+    lists[0] = check;
+    lists[1] = reply;
+    for (j = 0; j < 2; j++) {
+        head = j == 0 ? &options->check : &options->reply;
+        if (lists[j] == NULL) {
+            if (base != NULL) {
+                *head = DHCPOptionCopy(j == 0 ? base->check : base->reply);
+            }
+            continue;
+        }
+        if (Tcl_SplitList(interp, lists[j], &argc, &argv) != TCL_OK) {
+            DHCPRangeOptionsFree(options);
+            Tcl_AppendResult(interp, "invalid list: ", lists[j], NULL);
+            return NULL;
+        }
+        for (i = 0; i < argc - 1; i += 2) {
+            opt = DHCPOptionCreate(argv[i], argv[i+1]);
+            if (opt == NULL) {
+                Tcl_AppendResult(interp, "unknown option: ", argv[i], NULL);
+                Tcl_Free((char *) argv);
+                DHCPRangeOptionsFree(options);
+                return NULL;
+            }
+            opt->next = *head;
+            *head = opt;
+        }
+        Tcl_Free((char *) argv);
+    }
+    DHCPRangeOptionsCompile(options);
+    return options;
+}
+
+static void DHCPRangeOptionsFree(DHCPRangeOptions *options)
+{
+    if (options != NULL) {
+        DHCPOptionFree(options->check);
+        DHCPOptionFree(options->reply);
+        ns_free(options->tlv.data);
+        ns_free(options);
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeOptionsCompile --
+ *
+ *	Encode reply options into TLVs which are copied into replies as is,
+ *      the first option of each code is used, sub-options are merged
+ *      into one option of their parent code.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Fills options->tlv
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPRangeOptionsCompile(DHCPRangeOptions *options)
+{
+    int code, size, start;
+    char hdr[2];
+    u_int8_t buf[4];
+    Ns_DString ds;
+    DHCPOption *opt, *sub;
+
+    Ns_DStringInit(&ds);
+    for (opt = options->reply; opt != NULL; opt = opt->next) {
+        code = opt->dict->code;
+        if (options->tlv.length[code]) {
+            continue;
+        }
+        start = ds.length;
+        if (!opt->dict->subcode) {
+            if (ds.length + opt->size + 2 > OPTION_SIZE) {
+                break;
+            }
+            hdr[0] = code;
+            hdr[1] = opt->size;
+            Ns_DStringNAppend(&ds, hdr, 2);
+            Ns_DStringNAppend(&ds, (char*)getOptionData(opt, buf), opt->size);
+        } else {
+            hdr[0] = code;
+            hdr[1] = 0;
+            Ns_DStringNAppend(&ds, hdr, 2);
+            for (sub = opt, size = 0; sub != NULL; sub = sub->next) {
+                if (sub->dict->code != code || !sub->dict->subcode || size + sub->size + 2 > 255 ||
+                    start + 2 + size + sub->size + 2 > OPTION_SIZE) {
+                    continue;
+                }
+                hdr[0] = sub->dict->subcode;
+                hdr[1] = sub->size;
+                Ns_DStringNAppend(&ds, hdr, 2);
+                Ns_DStringNAppend(&ds, (char*)getOptionData(sub, buf), sub->size);
+                size += sub->size + 2;
+            }
+            ds.string[start + 1] = size;
+        }
+        options->tlv.offset[code] = start;
+        options->tlv.length[code] = ds.length - start;
+    }
+    options->tlv.size = ds.length;
+    options->tlv.data = ns_malloc(ds.length + 1);
+    memcpy(options->tlv.data, ds.string, ds.length);
+    Ns_DStringFree(&ds);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeFindFast --
+ *
+ *	Find range containing the address, must be called inside a read
+ *      section started by DHCPRangeEnter.
+ *
+ * Results:
+ *	Range or NULL
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPRange *DHCPRangeFindFast(DHCPServer *srvPtr, u_int32_t ipaddr)
+{
+    int i;
+    DHCPRangeTable *table = __atomic_load_n(&srvPtr->ranges, __ATOMIC_ACQUIRE);
+
+    ipaddr = ntohl(ipaddr);
+    i = DHCPRangeSearch(table, ipaddr);
+    return i >= 0 && ipaddr <= table->items[i]->end ? table->items[i] : NULL;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeFind --
+ *
+ *	Find range for the request, ranges pinned to the client MAC address
+ *      are tried first, then the range containing yiaddr. Without yiaddr
+ *      the first range which check options match is used, ranges without
+ *      check options are never selected this way. Range selected by a
+ *      plugin classify hook is used as is. Called from request
+ *      processing which runs inside a read section.
+ *
+ * Results:
+ *	Range which check options match the request or NULL
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPRange *DHCPRangeFind(DHCPRequest *req)
+{
+    int i, low, high, mid;
+    DHCPRange *range = NULL;
+    u_int32_t yiaddr = ntohl(req->in.yiaddr);
+    DHCPRangeTable *table = __atomic_load_n(&req->srvPtr->ranges, __ATOMIC_ACQUIRE);
+
+    if (req->range != NULL) {
+        return req->range;
+    }
+    low = 0;
+    high = table->npinned;
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (strcmp(table->pinned[mid].macaddr, req->macaddr) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (i = low; range == NULL && i < table->npinned && !strcmp(table->pinned[i].macaddr, req->macaddr); i++) {
+        range = DHCPRangeCheck(req, table->pinned[i].range);
+    }
+    if (range == NULL && yiaddr) {
+        i = DHCPRangeSearch(table, yiaddr);
+        if (i >= 0 && yiaddr <= table->items[i]->end) {
+            range = DHCPRangeCheck(req, table->items[i]);
+        }
+    }
+    if (range == NULL && !yiaddr && table->classes != NULL) {
+        range = DHCPRangeClassify(req, table);
+    }
+    return range;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRangeClassify --
+ *
+ *	Find the first range in table order which check options match the
+ *      request. Ranges are indexed by the value of their first check rule,
+ *      so only ranges whose first rule matches are checked further.
+ *
+ * Results:
+ *	Range or NULL
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static DHCPRange *DHCPRangeClassify(DHCPRequest *req, DHCPRangeTable *table)
+{
+    int i, j;
+    char key[600];
+    DHCPOption option;
+    DHCPRangeClass *cls;
+    Tcl_HashEntry *hPtr;
+    DHCPRange *range = NULL;
+
+    for (i = 0; i < table->ncodes; i++) {
+        if (DHCPRequestOption(req, table->codes[i] & 0xff, table->codes[i] >> 8, &option) == NULL) {
+            continue;
+        }
+        hPtr = Tcl_FindHashEntry(table->classes, DHCPRangeClassKey(key, &option));
+        if (hPtr == NULL) {
+            continue;
+        }
+        cls = (DHCPRangeClass*)Tcl_GetHashValue(hPtr);
+        for (j = 0; j < cls->count; j++) {
+            if (range != NULL && cls->items[j]->start >= range->start) {
+                break;
+            }
+            if (DHCPRangeCheck(req, cls->items[j]) != NULL) {
+                range = cls->items[j];
+                break;
+            }
+        }
+    }
+    return range;
+}
+
+/* Build classification index from the first check rule of every range */
+static void DHCPRangeTableClasses(DHCPRangeTable *table)
+{
+    int i, j, isNew;
+    char key[600];
+    u_int16_t code;
+    DHCPOption *opt;
+    DHCPRangeClass *cls;
+    Tcl_HashEntry *hPtr;
+
+    for (i = 0; i < table->count; i++) {
+        opt = table->items[i]->options->check;
+        if (opt == NULL) {
+            continue;
+        }
+        if (table->classes == NULL) {
+            table->classes = ns_malloc(sizeof(Tcl_HashTable));
+            Tcl_InitHashTable(table->classes, TCL_STRING_KEYS);
+            table->codes = ns_malloc(table->count * sizeof(u_int16_t));
+        }
+        code = opt->dict->code | (opt->dict->subcode << 8);
+        for (j = 0; j < table->ncodes && table->codes[j] != code; j++);
+        if (j == table->ncodes) {
+            table->codes[table->ncodes++] = code;
+        }
+        hPtr = Tcl_CreateHashEntry(table->classes, DHCPRangeClassKey(key, opt), &isNew);
+        cls = isNew ? NULL : (DHCPRangeClass*)Tcl_GetHashValue(hPtr);
+        cls = ns_realloc(cls, sizeof(DHCPRangeClass) + (cls ? cls->count : 0) * sizeof(DHCPRange*));
+        if (isNew) {
+            cls->count = 0;
+        }
+        cls->items[cls->count++] = table->items[i];
+        Tcl_SetHashValue(hPtr, cls);
+    }
+}
+
+/* Hash key of an option value, compared the same way as DHCPRangeCheck does */
+static char *DHCPRangeClassKey(char *buf, DHCPOption *opt)
+{
+    int i, size;
+    char *p;
+    u_int8_t *data;
+    static const char hex[] = "0123456789abcdef";
+
+    switch (opt->dict->flags & 0x00ff) {
+    case OPTION_BOOLEAN:
+    case OPTION_U8:
+        data = &opt->value.u8;
+        size = 1;
+        break;
+
+    case OPTION_IPADDR:
+    case OPTION_U32:
+    case OPTION_S32:
+        data = (u_int8_t*)&opt->value.u32;
+        size = 4;
+        break;
+
+    case OPTION_S16:
+    case OPTION_U16:
+        data = (u_int8_t*)&opt->value.u16;
+        size = 2;
+        break;
+
+    default:
+        data = opt->ptr;
+        size = opt->size;
+    }
+    p = buf + sprintf(buf, "%d.%d.", opt->dict->code, opt->dict->subcode);
+    for (i = 0; i < size; i++) {
+        *p++ = hex[data[i] >> 4];
+        *p++ = hex[data[i] & 0x0f];
+    }
+    *p = 0;
+    return buf;
+}
+
+static DHCPRange *DHCPRangeCheck(DHCPRequest *req, DHCPRange *range)
+{
+    char rc;
+    DHCPOption *opt, option;
+
+    for (opt = __atomic_load_n(&range->options, __ATOMIC_ACQUIRE)->check; opt; opt = opt->next) {
+        if (DHCPRequestOption(req, opt->dict->code, opt->dict->subcode, &option) == NULL) {
+            break;
+        }
+        switch (opt->dict->flags & 0x00ff) {
+        case OPTION_BOOLEAN:
+        case OPTION_U8:
+            rc = opt->value.u8 == option.value.u8 ? 0 : -1;
+            break;
+
+        case OPTION_IPADDR:
+        case OPTION_U32:
+        case OPTION_S32:
+            rc = opt->value.u32 == option.value.u32 ? 0 : -1;
+            break;
 
-    req->reply.yiaddr = req->in.yiaddr;
-    req->reply.siaddr = req->in.siaddr;
-    DHCPSend(req, DHCP_ACK);
-}
+        case OPTION_S16:
+        case OPTION_U16:
+            rc = opt->value.u16 == option.value.u16 ? 0 : -1;
+            break;
 
-static void DHCPProcessInform(DHCPRequest *req)
-{
-    req->range = DHCPRangeFind(req);
-    if (req->range == NULL) {
-        return;
+        default:
+            rc = opt->size == option.size ? memcmp(option.ptr, opt->ptr, opt->size) : -1;
+            break;
+        }
+        if (rc) {
+            break;
+        }
     }
 
-    req->reply.yiaddr = req->in.yiaddr;
-    req->reply.siaddr = req->in.siaddr;
-    DHCPSend(req, DHCP_ACK);
-}
+    /*
+     * If opt == NULL that means we scanned all options and all match or
+     * we do not have any check options for this range at all
+     */
 
-static void DHCPProcessRelease(DHCPRequest *req)
-{
+    return opt == NULL ? range : NULL;
 }
 
-static void DHCPSendNAK(DHCPRequest *req)
+static void DHCPRangeList(DHCPRange *range, Ns_DString *ds)
 {
-    req->reply.msgtype = DHCP_NAK;
-    req->out.op = BOOTREPLY;
-    req->out.htype = ETH_10MB;
-    req->out.hlen = ETH_10MB_LEN;
-    req->out.xid = req->in.xid;
-    req->out.hops = req->in.hops;
-    req->out.flags = req->in.flags;
-    req->out.ciaddr = req->in.ciaddr;
-    req->out.giaddr = req->in.giaddr;
-    req->out.cookie = htonl(DHCP_MAGIC);
-    memcpy(req->out.macaddr, req->in.macaddr, 6);
-
-    addOption8(req, DHCP_MESSAGE_TYPE, DHCP_NAK);
-    addOption(req, DHCP_VENDOR_CLASS_IDENTIFIER, 7, "nsdhcpd");
-    addOptionIP(req, DHCP_SERVER_IDENTIFIER, req->srvPtr->ipaddr.sin_addr.s_addr);
-    addOption(req, DHCP_END, 0, NULL);
+    int i;
+    char buf[256];
+    DHCPOption *opt, *options[2];
+    DHCPRangeOptions *ropts = __atomic_load_n(&range->options, __ATOMIC_ACQUIRE);
 
-    DHCPRequestReply(req);
-}
+    Ns_DStringPrintf(ds, "%s ", addr2str(htonl(range->start)));
+    Ns_DStringPrintf(ds, "%s ", addr2str(htonl(range->end)));
+    Ns_DStringPrintf(ds, "%s ", ropts->macaddr);
+    options[0] = ropts->check;
+    options[1] = ropts->reply;
+    for (i = 0; i < 2; i++) {
+        Ns_DStringAppend(ds, "{");
+        for (opt = options[i]; opt; opt = opt->next) {
+            Ns_DStringPrintf(ds, "%s ", opt->dict->name);
+            switch (opt->dict->flags & 0x00ff) {
+            case OPTION_IPADDR:
+                Ns_DStringPrintf(ds, "%s ", addr2str(opt->value.u32));
+                break;
 
-static DHCPLease *DHCPLeaseCreate(u_int32_t ipaddr, char *macaddr, u_int32_t lease_time, u_int32_t expires)
-{
-    DHCPLease *lease = NULL;
+            case OPTION_BOOLEAN:
+            case OPTION_U8:
+                Ns_DStringPrintf(ds, "%d ", (int)opt->value.u8);
+                break;
 
-    lease = (DHCPLease*)ns_calloc(1, sizeof(DHCPLease));
-    lease->ipaddr = ipaddr;
-    lease->expires = expires;
-    lease->lease_time = lease_time;
-    if (macaddr != NULL) {
-        memcpy(lease->macaddr, macaddr, 12);
-    }
-    Ns_Log(Notice, "LeaseCreate: %s %s %u", addr2str(ipaddr), macaddr, lease_time);
-    return lease;
-}
+            case OPTION_U32:
+            case OPTION_S32:
+                Ns_DStringPrintf(ds, "%u ", opt->value.u32);
+                break;
 
-static DHCPLease *DHCPLeaseAlloc(DHCPRange *range)
-{
-    u_int32_t n, ipaddr;
-    Tcl_HashEntry *entry;
-    DHCPLease *lease = NULL;
+            case OPTION_S16:
+            case OPTION_U16:
+                Ns_DStringPrintf(ds, "%d ", (int)opt->value.u16);
+                break;
 
-    Ns_MutexLock(&range->lock);
-    for (ipaddr = range->start; ipaddr <= range->end; ipaddr++) {
-        entry = Tcl_FindHashEntry(&range->leases, (char *)ipaddr);
-        if (entry != NULL) {
-            if (lease->expires < time(0)) {
-                ns_free(Tcl_GetHashValue(entry));
-                Tcl_DeleteHashEntry(entry);
-                entry = NULL;
+            default:
+                Ns_DStringPrintf(ds, "{%s} ", bin2hex(buf, opt->ptr, opt->size));
             }
         }
-        if (entry == NULL) {
-            lease = DHCPLeaseCreate(ipaddr, NULL, range->lease_time, time(0) + range->lease_time);
-            entry = Tcl_CreateHashEntry(&range->leases, (char*)lease->ipaddr, (int*)&n);
-            Tcl_SetHashValue(entry, (ClientData)lease);
-            break;
-        }
+        Ns_DStringAppend(ds, "} ");
     }
-    Ns_MutexUnlock(&range->lock);
-    return lease;
 }
 
-static DHCPLease *DHCPLeaseFind(DHCPRange *range, u_int32_t ipaddr, char *macaddr)
+static void DHCPRangeFree(DHCPRange *range)
 {
-    DHCPLease *lease = NULL;
+    int k;
+    u_int32_t i;
+    DHCPShard *shard;
     Tcl_HashSearch search;
     Tcl_HashEntry *entry;
 
-    Ns_MutexLock(&range->lock);
-    if (macaddr == NULL) {
-        entry = Tcl_FindHashEntry(&range->leases, (char*)ipaddr);
-
-    } else {
-        entry = Tcl_FirstHashEntry(&range->leases, &search);
-        while (entry) {
-            lease = (DHCPLease*)Tcl_GetHashValue(entry);
-            if ((ipaddr && ipaddr == lease->ipaddr) ||
-                (*macaddr && !memcmp(macaddr, lease->macaddr, 12))) {
-                break;
+    if (range == NULL) {
+        return;
+    }
+    DHCPRangeOptionsFree(range->options);
+    for (k = 0; k < range->nshards; k++) {
+        shard = &range->shards[k];
+        if (range->records != NULL) {
+            for (i = shard->start; i <= shard->end; i++) {
+                DHCPLeaseFree(range, htonl(i));
+            }
+        } else {
+            while ((entry = Tcl_FirstHashEntry(&shard->leases, &search)) != NULL) {
+                DHCPLeaseFree(range, ((DHCPLease*)Tcl_GetHashValue(entry))->ipaddr);
             }
-            entry = Tcl_NextHashEntry(&search);
         }
+        Tcl_DeleteHashTable(&shard->leases);
+        Tcl_DeleteHashTable(&shard->clientids);
+        ns_free(shard->pool.bits);
+        Ns_MutexDestroy(&shard->lock);
     }
-    Ns_MutexUnlock(&range->lock);
-    // Check lease validity
-    if (lease) {
-        if (lease->expires < time(0)) {
-            Tcl_DeleteHashEntry(entry);
-            ns_free(lease);
-            lease = NULL;
-        }
+    for (k = 0; k < INDEX_STRIPES; k++) {
+        Tcl_DeleteHashTable(&range->index[k].macaddrs);
+        Tcl_DeleteHashTable(&range->index[k].clientids);
+        Ns_MutexDestroy(&range->index[k].lock);
     }
-    return lease;
+    ns_free(range->shards);
+    ns_free(range->records);
+    ns_free(range);
 }
 
-static int DHCPLeaseAdd(DHCPServer *srvPtr, u_int32_t ipaddr, char *macaddr, u_int32_t lease_time, u_int32_t expires)
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPShardInit --
+ *
+ *	Split the range into blocks of consecutive addresses, each with its
+ *      own lock, lease tables and free address bitmap. Leases of different
+ *      shards can be created, renewed and expired concurrently.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	Number of shards is limited by the range size
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPShardInit(DHCPRange *range, int nshards)
 {
-    int n = 0;
-    DHCPRange *range;
-    Tcl_HashEntry *entry;
+    int k;
+    DHCPShard *shard;
+    u_int64_t size = (u_int64_t)(range->end - range->start) + 1;
 
-    range = DHCPRangeFindFast(srvPtr, ipaddr);
-    if (range != NULL) {
-        Ns_MutexLock(&range->lock);
-        entry = Tcl_CreateHashEntry(&range->leases, (char*)ipaddr, &n);
-        if (!n) {
-            ns_free(Tcl_GetHashValue(entry));
-        }
-        Tcl_SetHashValue(entry, (ClientData)DHCPLeaseCreate(ipaddr, macaddr, lease_time, expires));
-        Ns_MutexUnlock(&range->lock);
+    if (nshards < 1) {
+        nshards = 1;
+    }
+    if ((u_int64_t)nshards > size) {
+        nshards = size;
+    }
+    range->shardsize = size / nshards + (size % nshards ? 1 : 0);
+    range->nshards = size / range->shardsize + (size % range->shardsize ? 1 : 0);
+    range->shards = ns_calloc(range->nshards, sizeof(DHCPShard));
+    for (k = 0; k < range->nshards; k++) {
+        shard = &range->shards[k];
+        shard->start = range->start + k * range->shardsize;
+        shard->end = k == range->nshards - 1 ? range->end : shard->start + range->shardsize - 1;
+        Tcl_InitHashTable(&shard->leases, TCL_ONE_WORD_KEYS);
+        Tcl_InitHashTable(&shard->clientids, TCL_ONE_WORD_KEYS);
+        DHCPPoolInit(shard);
     }
-    return n;
 }
 
-static void DHCPLeaseList(DHCPRange *range, Ns_DString *ds)
+/* Shard owning the address in network byte order, NULL if outside of the range */
+static DHCPShard *DHCPShardGet(DHCPRange *range, u_int32_t ipaddr)
 {
-    DHCPLease *lease;
-    Tcl_HashSearch search;
-    Tcl_HashEntry *entry;
+    u_int32_t n = ntohl(ipaddr);
 
-    Ns_MutexLock(&range->lock);
-    entry = Tcl_FirstHashEntry(&range->leases, &search);
-    while (entry) {
-        lease = (DHCPLease*)Tcl_GetHashValue(entry);
-        Ns_DStringPrintf(ds, "%s %s %u %u ", addr2str(lease->ipaddr), lease->macaddr, lease->lease_time, lease->expires);
-        entry = Tcl_NextHashEntry(&search);
+    if (n < range->start || n > range->end) {
+        return NULL;
     }
-    Ns_MutexUnlock(&range->lock);
+    return &range->shards[(n - range->start) / range->shardsize];
 }
 
-static void DHCPLeaseDel(DHCPServer *srvPtr, u_int32_t ipaddr)
+/* Lock all shards for whole range operations, always in ascending order */
+static void DHCPRangeLock(DHCPRange *range)
 {
-    DHCPRange *range;
-    Tcl_HashEntry *entry;
+    int k;
 
-    range = DHCPRangeFindFast(srvPtr, ipaddr);
-    if (range != NULL) {
-        Ns_MutexLock(&range->lock);
-        entry = Tcl_FindHashEntry(&range->leases, (char *)ipaddr);
-        if (entry) {
-            ns_free(Tcl_GetHashValue(entry));
-            Tcl_DeleteHashEntry(entry);
-        }
-        Ns_MutexUnlock(&range->lock);
+    for (k = 0; k < range->nshards; k++) {
+        Ns_MutexLock(&range->shards[k].lock);
     }
 }
 
-static DHCPRange *DHCPRangeFindFast(DHCPServer *srvPtr, u_int32_t ipaddr)
+static void DHCPRangeUnlock(DHCPRange *range)
 {
-    DHCPRange *range;
+    int k;
 
-    Ns_MutexLock(&srvPtr->lock);
-    for (range = srvPtr->ranges; range; range = range->next) {
-        if (ipaddr >= range->start && ipaddr <= range->end) {
-            break;
-        }
+    for (k = range->nshards - 1; k >= 0; k--) {
+        Ns_MutexUnlock(&range->shards[k].lock);
     }
-    Ns_MutexUnlock(&srvPtr->lock);
-    return range;
 }
 
-static DHCPRange *DHCPRangeFind(DHCPRequest *req)
-{
-    char rc;
-    DHCPRange *range;
-    DHCPOption *opt, option;
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPPoolInit --
+ *
+ *	Setup free address bitmap for the shard, bits past the end of the
+ *      shard are marked as used so allocation never returns them.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
 
-    Ns_MutexLock(&req->srvPtr->lock);
-    for (range = req->srvPtr->ranges; range; range = range->next) {
-        if ((req->in.yiaddr && req->in.yiaddr >= range->start && req->in.yiaddr <= range->end) ||
-            (range->macaddr[0] && !memcmp(req->macaddr, range->macaddr, 12))) {
+static void DHCPPoolInit(DHCPShard *shard)
+{
+    u_int32_t size = shard->end - shard->start + 1, tail = size % 32;
+
+    shard->pool.words = size / 32 + (tail ? 1 : 0);
+    shard->pool.bits = ns_calloc(shard->pool.words, sizeof(u_int32_t));
+    shard->pool.nfree = size;
+    shard->pool.next = 0;
+    if (tail) {
+        shard->pool.bits[shard->pool.words - 1] = ~((1U << tail) - 1);
+    }
+}
 
-            for (opt = range->check; opt; opt = opt->next) {
-                if (getOption(&req->in, opt->dict->code, opt->dict->subcode, &option) == NULL) {
-                    break;
-                }
-                switch (opt->dict->flags & 0x00ff) {
-                case OPTION_BOOLEAN:
-                case OPTION_U8:
-                    rc = opt->value.u8 == option.value.u8 ? 0 : -1;
-                    break;
-
-                case OPTION_IPADDR:
-                case OPTION_U32:
-                case OPTION_S32:
-                    rc = opt->value.u32 == option.value.u32 ? 0 : -1;
-                    break;
-
-                case OPTION_S16:
-                case OPTION_U16:
-                    rc = opt->value.u16 == option.value.u16 ? 0 : -1;
-                    break;
-
-                default:
-                    rc = opt->size == option.size ? memcmp(option.ptr, opt->ptr, opt->size) : -1;
-                    break;
-                }
-                if (rc) {
-                    break;
-                }
-            }
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPPoolSet --
+ *
+ *	Mark address as used or free, shard must be locked
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
 
-            /*
-             * If opt == NULL that means we scanned all options and all match or
-             * we do not have any check options for this range at all
-             */
+static void DHCPPoolSet(DHCPShard *shard, u_int32_t ipaddr, int used)
+{
+    u_int32_t n, bit;
 
-            if (opt == NULL) {
-                break;
-            }
+    n = ntohl(ipaddr);
+    if (n < shard->start || n > shard->end) {
+        return;
+    }
+    n -= shard->start;
+    bit = 1U << (n % 32);
+    if (used) {
+        if (!(shard->pool.bits[n / 32] & bit)) {
+            shard->pool.bits[n / 32] |= bit;
+            shard->pool.nfree--;
+        }
+    } else {
+        if (shard->pool.bits[n / 32] & bit) {
+            shard->pool.bits[n / 32] &= ~bit;
+            shard->pool.nfree++;
         }
     }
-    Ns_MutexUnlock(&req->srvPtr->lock);
-    return range;
 }
 
-static void DHCPRangeList(DHCPRange *range, Ns_DString *ds)
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPPoolAlloc --
+ *
+ *	Find next free address starting from the rotating cursor, the
+ *      cursor stays at the last used word so subsequent allocations
+ *      continue where the previous one stopped.
+ *
+ * Results:
+ *	NS_OK and address in network byte order or NS_ERROR if shard is full
+ *
+ * Side effects:
+ *  	Address is not marked as used, this is done by DHCPLeaseCreate
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPPoolAlloc(DHCPShard *shard, u_int32_t *ipaddr)
 {
-    int i;
-    char buf[256];
-    DHCPOption *opt, *options[2];
+    u_int32_t i, w;
 
-    Ns_DStringPrintf(ds, "%s ", addr2str(range->start));
-    Ns_DStringPrintf(ds, "%s ", addr2str(range->end));
-    Ns_DStringPrintf(ds, "%s ", range->macaddr);
-    options[0] = range->check;
-    options[1] = range->reply;
-    for (i = 0; i < 2; i++) {
-        Ns_DStringAppend(ds, "{");
-        for (opt = options[i]; opt; opt = opt->next) {
-            Ns_DStringPrintf(ds, "%s ", opt->dict->name);
-            switch (opt->dict->flags & 0x00ff) {
-            case OPTION_IPADDR:
-                Ns_DStringPrintf(ds, "%s ", addr2str(opt->value.u32));
-                break;
+    if (shard->pool.nfree == 0) {
+        return NS_ERROR;
+    }
+    for (i = 0; i < shard->pool.words; i++) {
+        w = shard->pool.next;
+        if (shard->pool.bits[w] != 0xFFFFFFFF) {
+            *ipaddr = htonl(shard->start + w * 32 + ffs(~shard->pool.bits[w]) - 1);
+            return NS_OK;
+        }
+        if (++shard->pool.next >= shard->pool.words) {
+            shard->pool.next = 0;
+        }
+    }
+    return NS_ERROR;
+}
 
-            case OPTION_BOOLEAN:
-            case OPTION_U8:
-                Ns_DStringPrintf(ds, "%d ", (int)opt->value.u8);
-                break;
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPSlabAlloc --
+ *
+ *	Allocate zeroed object from the calling thread's cache, an empty
+ *      cache is refilled from the shared free list of the slab, which
+ *      grows by SLAB_CHUNK objects at a time.
+ *
+ * Results:
+ *	Pointer to the object
+ *
+ * Side effects:
+ *  	Thread cache is created on first use
+ *
+ *----------------------------------------------------------------------
+ */
 
-            case OPTION_U32:
-            case OPTION_S32:
-                Ns_DStringPrintf(ds, "%u ", opt->value.u32);
-                break;
+static void *DHCPSlabAlloc(int type)
+{
+    char *chunk;
+    void *obj;
+    u_int32_t n;
+    DHCPSlab *slab = &slabs[type];
+    DHCPSlabCache *cache = DHCPSlabGetCache();
+
+    if (cache->free[type] == NULL) {
+        Ns_MutexLock(&slabLock);
+        if (slab->free == NULL) {
+            chunk = ns_malloc(SLAB_CHUNK * SLAB_ALIGN(slab->size));
+            for (n = 0; n < SLAB_CHUNK; n++) {
+                obj = chunk + n * SLAB_ALIGN(slab->size);
+                *(void**)obj = slab->free;
+                slab->free = obj;
+            }
+            slab->nfree += SLAB_CHUNK;
+            slab->total += SLAB_CHUNK;
+            slab->slabs++;
+        }
+        for (n = 0; n < SLAB_CHUNK && slab->free != NULL; n++) {
+            obj = slab->free;
+            slab->free = *(void**)obj;
+            *(void**)obj = cache->free[type];
+            cache->free[type] = obj;
+        }
+        slab->nfree -= n;
+        cache->nfree[type] += n;
+        Ns_MutexUnlock(&slabLock);
+    }
+    obj = cache->free[type];
+    cache->free[type] = *(void**)obj;
+    cache->nfree[type]--;
+    memset(obj, 0, slab->size);
+    return obj;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPSlabFree --
+ *
+ *	Return object to the calling thread's cache, objects are often
+ *      freed by another thread than the one which allocated them, so
+ *      half of an overflowing cache is moved to the shared free list.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
 
-            case OPTION_S16:
-            case OPTION_U16:
-                Ns_DStringPrintf(ds, "%d ", (int)opt->value.u16);
-                break;
+static void DHCPSlabFree(int type, void *obj)
+{
+    DHCPSlabCache *cache;
 
-            default:
-                Ns_DStringPrintf(ds, "{%s} ", bin2hex(buf, opt->ptr, opt->size));
-            }
-        }
-        Ns_DStringAppend(ds, "} ");
+    if (obj == NULL) {
+        return;
+    }
+    cache = DHCPSlabGetCache();
+    *(void**)obj = cache->free[type];
+    cache->free[type] = obj;
+    if (++cache->nfree[type] > SLAB_CACHE) {
+        Ns_MutexLock(&slabLock);
+        DHCPSlabRelease(cache, type, SLAB_CACHE / 2);
+        Ns_MutexUnlock(&slabLock);
     }
 }
 
-static void DHCPRangeFree(DHCPRange *range)
+static DHCPSlabCache *DHCPSlabGetCache(void)
 {
-    DHCPOption *opt, *next;
-    Tcl_HashSearch search;
-    Tcl_HashEntry *entry;
+    DHCPSlabCache *cache = Ns_TlsGet(&slabTls);
+
+    if (cache == NULL) {
+        cache = ns_calloc(1, sizeof(DHCPSlabCache));
+        Ns_MutexLock(&slabLock);
+        cache->next = slabCaches;
+        slabCaches = cache;
+        Ns_MutexUnlock(&slabLock);
+        Ns_TlsSet(&slabTls, cache);
+    }
+    return cache;
+}
 
-    if (range == NULL) {
-        return;
+/* Move objects from the thread cache to the shared free list, slabLock must be held */
+static void DHCPSlabRelease(DHCPSlabCache *cache, int type, u_int32_t count)
+{
+    void *obj;
+    DHCPSlab *slab = &slabs[type];
+
+    while (count-- > 0 && (obj = cache->free[type]) != NULL) {
+        cache->free[type] = *(void**)obj;
+        cache->nfree[type]--;
+        *(void**)obj = slab->free;
+        slab->free = obj;
+        slab->nfree++;
     }
-    opt = range->check;
-    while (opt != NULL) {
-        next = opt->next;
-        ns_free(opt->ptr);
-        ns_free(opt);
-        opt = next;
+}
+
+/* Thread exit, cached objects go back to the shared free lists */
+static void DHCPSlabCleanup(void *arg)
+{
+    int type;
+    DHCPSlabCache *cache = (DHCPSlabCache*)arg, **prev;
+
+    Ns_MutexLock(&slabLock);
+    for (type = 0; type < SLAB_TYPES; type++) {
+        DHCPSlabRelease(cache, type, cache->nfree[type]);
     }
-    opt = range->reply;
-    while (opt != NULL) {
-        next = opt->next;
-        ns_free(opt->ptr);
-        ns_free(opt);
-        opt = next;
+    for (prev = &slabCaches; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == cache) {
+            *prev = cache->next;
+            break;
+        }
     }
-    entry = Tcl_FirstHashEntry(&range->leases, &search);
-    while (entry) {
-        ns_free(Tcl_GetHashValue(entry));
-        entry = Tcl_NextHashEntry(&search);
+    Ns_MutexUnlock(&slabLock);
+    ns_free(cache);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPSlabStats --
+ *
+ *	Append occupancy of all slabs as name {size slabs total inuse
+ *      shared cached} list, thread cache counters are read without
+ *      their owners' cooperation so the numbers are approximate.
+ *
+ * Results:
+ *	None
+ *
+ * Side effects:
+ *  	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPSlabStats(Ns_DString *ds)
+{
+    int type;
+    u_int32_t cached;
+    DHCPSlabCache *cache;
+
+    Ns_MutexLock(&slabLock);
+    for (type = 0; type < SLAB_TYPES; type++) {
+        cached = 0;
+        for (cache = slabCaches; cache != NULL; cache = cache->next) {
+            cached += cache->nfree[type];
+        }
+        Ns_DStringPrintf(ds, "%s {size %u slabs %u total %u inuse %u shared %u cached %u} ",
+                         slabs[type].name, (unsigned)slabs[type].size, slabs[type].slabs, slabs[type].total,
+                         slabs[type].total - slabs[type].nfree - cached, slabs[type].nfree, cached);
     }
-    Tcl_DeleteHashTable(&range->leases);
-    ns_free(range);
+    Ns_MutexUnlock(&slabLock);
 }
 
 static DHCPOption *DHCPOptionCreate(const char *name, const char *value)
@@ -2131,7 +7151,7 @@ static DHCPOption *DHCPOptionCreate(const char *name, const char *value)
     if (dict == NULL) {
         return NULL;
     }
-    opt = (DHCPOption*)ns_malloc(sizeof(DHCPOption));
+    opt = (DHCPOption*)DHCPSlabAlloc(SLAB_OPTION);
     opt->dict = dict;
     switch (dict->flags & 0x00ff) {
     case OPTION_BOOLEAN:
@@ -2171,6 +7191,36 @@ static DHCPOption *DHCPOptionCreate(const char *name, const char *value)
     return opt;
 }
 
+static DHCPOption *DHCPOptionCopy(DHCPOption *opt)
+{
+    DHCPOption *copy, *head = NULL, **tail = &head;
+
+    for (; opt != NULL; opt = opt->next) {
+        copy = (DHCPOption*)DHCPSlabAlloc(SLAB_OPTION);
+        *copy = *opt;
+        copy->next = NULL;
+        if (opt->ptr != NULL) {
+            copy->ptr = ns_malloc(opt->size + 1);
+            memcpy(copy->ptr, opt->ptr, opt->size + 1);
+        }
+        *tail = copy;
+        tail = &copy->next;
+    }
+    return head;
+}
+
+static void DHCPOptionFree(DHCPOption *opt)
+{
+    DHCPOption *next;
+
+    while (opt != NULL) {
+        next = opt->next;
+        ns_free(opt->ptr);
+        DHCPSlabFree(SLAB_OPTION, opt);
+        opt = next;
+    }
+}
+
 static char *addr2str(u_int32_t addr)
 {
     struct in_addr in;
@@ -2182,8 +7232,8 @@ static char *str2mac(char *macaddr, char *str)
 {
     int i, j;
     for (i = j = 0; j < 12 && str[i]; i++) {
-        if (isdigit(str[i])) {
-            macaddr[j++] = str[i];
+        if (isxdigit(str[i])) {
+            macaddr[j++] = tolower(str[i]);
         }
     }
     macaddr[j] = 0;
@@ -2245,6 +7295,20 @@ static char *bin2hex(char *buf, u_int8_t *bin, int size)
     return buf;
 }
 
+/* Always hex encoded, used for index keys where bin2hex may return raw bytes */
+static char *bin2str(char *buf, u_int8_t *bin, int size)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *p = buf;
+
+    while (size-- > 0) {
+        *p++ = hex[(*bin & 0xf0) >> 4];
+        *p++ = hex[*bin++ & 0x0f];
+    }
+    *p = 0;
+    return buf;
+}
+
 static void addOption8(DHCPRequest *req, u_int8_t code, u_int8_t data)
 {
     addOption(req, code, 1, &data);
@@ -2284,6 +7348,71 @@ static void addOption(DHCPRequest *req, u_int8_t code, u_int8_t size, void *data
     }
 }
 
+/* append already encoded options */
+static void addOptionData(DHCPRequest *req, u_int8_t *data, int size)
+{
+    if (size > (req->parser.end - req->parser.ptr)) {
+    	Ns_Log(Debug, "nsdhcpd: Option Too Big - type %d len %d", *data, size);
+    	return;
+    }
+    memcpy(req->parser.ptr, data, size);
+    req->parser.ptr += size;
+}
+
+/* append option from the list, sub-options are placed inside their parent option */
+static void addOptionValue(DHCPRequest *req, DHCPOption *opt)
+{
+    u_int8_t buf[4];
+
+    if (opt->dict->subcode) {
+        addOption(req, opt->dict->code, opt->size + 2, NULL);
+        addOption(req, opt->dict->subcode, opt->size, getOptionData(opt, buf));
+    } else {
+        addOption(req, opt->dict->code, opt->size, getOptionData(opt, buf));
+    }
+}
+
+/*
+ * Option data as sent in the packet. Options parsed from packets point to
+ * their data, numeric options created from strings keep only the value,
+ * which is encoded into buf in network byte order.
+ */
+static u_int8_t *getOptionData(DHCPOption *opt, u_int8_t *buf)
+{
+    u_int16_t u16;
+    u_int32_t u32;
+
+    if (opt->ptr != NULL) {
+        return opt->ptr;
+    }
+    switch (opt->dict->flags & 0x00ff) {
+    case OPTION_BOOLEAN:
+    case OPTION_U8:
+        buf[0] = opt->value.u8;
+        break;
+
+    case OPTION_IPADDR:
+        memcpy(buf, &opt->value.u32, 4);
+        break;
+
+    case OPTION_U32:
+    case OPTION_S32:
+        u32 = htonl(opt->value.u32);
+        memcpy(buf, &u32, 4);
+        break;
+
+    case OPTION_S16:
+    case OPTION_U16:
+        u16 = htons(opt->value.u16);
+        memcpy(buf, &u16, 2);
+        break;
+
+    default:
+        memset(buf, 0, 4);
+    }
+    return buf;
+}
+
 /* get an option with bounds checking (warning, not aligned). */
 static u_int8_t *getOption(DHCPPacket *pkt, u_int8_t code, u_int8_t subcode, DHCPOption *opt)
 {
@@ -2313,45 +7442,7 @@ static u_int8_t *getOption(DHCPPacket *pkt, u_int8_t code, u_int8_t subcode, DHC
                   continue;
               }
               if (opt) {
-                  opt->size = size;
-                  opt->dict = &dict[code];
-
-                  switch (code) {
-                  case DHCP_FQDN:
-                       opt->size -= 3;
-                       opt->ptr = ptr + i + OFFSET_DATA + 3;
-                       opt->value.u8 = *(ptr + i + OFFSET_DATA);
-                       break;
-
-                  default:
-                       opt->ptr = ptr + i + OFFSET_DATA;
-                       switch (dict[code].flags & 0x00ff) {
-                       case OPTION_IPADDR:
-                           opt->value.u32 = *((u_int32_t*)(ptr + i + OFFSET_DATA));
-                           break;
-
-                       case OPTION_BOOLEAN:
-                       case OPTION_U8:
-                           opt->value.u8 = *(ptr + i + OFFSET_DATA);
-                           break;
-
-                       case OPTION_S16:
-                           opt->value.s16 = ntohs(*((int16_t*)(ptr + i + OFFSET_DATA)));
-                           break;
-
-                       case OPTION_U16:
-                           opt->value.u16 = ntohs(*((int16_t*)(ptr + i + OFFSET_DATA)));
-                           break;
-
-                       case OPTION_U32:
-                           opt->value.u32 = ntohl(*((int32_t*)(ptr + i + OFFSET_DATA)));
-                           break;
-
-                       case OPTION_S32:
-                           opt->value.s32 = ntohl(*((int32_t*)(ptr + i + OFFSET_DATA)));
-                           break;
-                       }
-                  }
+                  getOptionValue(&dict[code], ptr + i + OFFSET_DATA, size, opt);
               }
               return ptr + i + OFFSET_DATA;
           }
@@ -2393,31 +7484,320 @@ static u_int8_t *getOption(DHCPPacket *pkt, u_int8_t code, u_int8_t subcode, DHC
     return NULL;
 }
 
+/* decode option data according to the dictionary type */
+static void getOptionValue(DHCPDict *dict, u_int8_t *data, int size, DHCPOption *opt)
+{
+    opt->size = size;
+    opt->dict = dict;
+    opt->ptr = data;
+
+    if (dict->code == DHCP_FQDN && dict->subcode == 0) {
+        if (size >= 3) {
+            opt->size -= 3;
+            opt->ptr = data + 3;
+        }
+        opt->value.u8 = *data;
+        return;
+    }
+    switch (dict->flags & 0x00ff) {
+    case OPTION_IPADDR:
+        opt->value.u32 = *((u_int32_t*)data);
+        break;
+
+    case OPTION_BOOLEAN:
+    case OPTION_U8:
+        opt->value.u8 = *data;
+        break;
+
+    case OPTION_S16:
+        opt->value.s16 = ntohs(*((int16_t*)data));
+        break;
+
+    case OPTION_U16:
+        opt->value.u16 = ntohs(*((int16_t*)data));
+        break;
+
+    case OPTION_U32:
+        opt->value.u32 = ntohl(*((int32_t*)data));
+        break;
+
+    case OPTION_S32:
+        opt->value.s32 = ntohl(*((int32_t*)data));
+        break;
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRequestIndex --
+ *
+ *      Walks all options of the received packet once, including the
+ *      overloaded file/sname fields and relay agent sub-options, and
+ *      records offset and length of every option in the request.
+ *      Options which do not fit into their field stop the walk, only
+ *      the first occurence of an option is recorded.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Fills req->index.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void DHCPRequestIndex(DHCPRequest *req)
+{
+    u_int8_t *ptr = req->in.options, *base = (u_int8_t*)&req->in;
+    int i = 0, size, code, length = OPTION_SIZE, over = 0, mode = OPTION_FIELD;
+
+    memset(&req->index, 0, sizeof(req->index));
+
+    for (;;) {
+        if (i >= length || ptr[i + OFFSET_CODE] == DHCP_END) {
+            if (mode == OPTION_FIELD && over & FILE_FIELD) {
+                ptr = req->in.file;
+                mode = FILE_FIELD;
+                length = sizeof(req->in.file);
+            } else
+            if (mode != SNAME_FIELD && over & SNAME_FIELD) {
+                ptr = req->in.sname;
+                mode = SNAME_FIELD;
+                length = sizeof(req->in.sname);
+            } else {
+                break;
+            }
+            i = 0;
+            continue;
+        }
+        code = ptr[i + OFFSET_CODE];
+        if (code == DHCP_PADDING) {
+            i++;
+            continue;
+        }
+        if (i + OFFSET_DATA > length || i + OFFSET_DATA + ptr[i + OFFSET_LEN] > length) {
+            Ns_Log(Debug, "nsdhcpd: option field too long: code=%d, %d > %d", code, i, length);
+            break;
+        }
+        size = ptr[i + OFFSET_LEN];
+        if (req->index.offset[code] == 0) {
+            req->index.offset[code] = ptr + i + OFFSET_DATA - base;
+            req->index.size[code] = size;
+        }
+        if (code == DHCP_OPTION_OVERLOAD && mode == OPTION_FIELD && size > 0) {
+            over = ptr[i + OFFSET_DATA];
+        }
+        i += size + OFFSET_DATA;
+    }
+
+    if (req->index.offset[DHCP_AGENT_OPTIONS] != 0) {
+        ptr = base + req->index.offset[DHCP_AGENT_OPTIONS];
+        length = req->index.size[DHCP_AGENT_OPTIONS];
+        for (i = 0; i + OFFSET_DATA <= length; i += size + OFFSET_DATA) {
+            code = ptr[i + OFFSET_CODE];
+            size = ptr[i + OFFSET_LEN];
+            if (i + OFFSET_DATA + size > length) {
+                Ns_Log(Debug, "nsdhcpd: agent option too long: code=%d, %d > %d", code, i, length);
+                break;
+            }
+            if (req->index.agent[code] == 0) {
+                req->index.agent[code] = ptr + i + OFFSET_DATA - base;
+                req->index.agentsize[code] = size;
+            }
+        }
+    }
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPRequestOption --
+ *
+ *      Returns option of the received packet from the request index,
+ *      with non-zero subcode the subcode is looked up among sub-options of
+ *      the relay agent option given as code, as the dictionary defines them.
+ *
+ * Results:
+ *      Pointer to the option data or NULL if not present.
+ *
+ * Side effects:
+ *      Fills opt if not NULL.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static u_int8_t *DHCPRequestOption(DHCPRequest *req, u_int8_t code, u_int8_t subcode, DHCPOption *opt)
+{
+    u_int8_t *data;
+    u_int16_t offset;
+    int size;
+    DHCPDict *dict;
+
+    if (subcode == 0) {
+        offset = req->index.offset[code];
+        size = req->index.size[code];
+        dict = &main_dict[code];
+    } else
+    if (code == DHCP_AGENT_OPTIONS) {
+        offset = req->index.agent[subcode];
+        size = req->index.agentsize[subcode];
+        dict = &agent_dict[subcode];
+    } else {
+        return NULL;
+    }
+    if (offset == 0) {
+        return NULL;
+    }
+    data = (u_int8_t*)&req->in + offset;
+    if (opt) {
+        getOptionValue(dict, data, size, opt);
+    }
+    return data;
+}
+
+/* Dictionary lookup by option name, case insensitive */
 static DHCPDict *getDict(const char *name)
 {
-    int i, len = strlen(name);
-    DHCPDict *dict = main_dict;
-    const char *part2 = strchr(name, '.'), *part1 = name;
+    int i;
+    char key[128];
+    DHCPDict *dict = NULL;
+    Tcl_HashEntry *hPtr;
 
-    if (part2 != NULL) {
-        len = part2 - part1;
-        part2++;
+    for (i = 0; name[i] != 0 && i < sizeof(key) - 1; i++) {
+        key[i] = tolower((unsigned char)name[i]);
     }
+    if (name[i] != 0) {
+        return NULL;
+    }
+    key[i] = 0;
+    Ns_RWLockRdLock(&dictLock);
+    hPtr = Tcl_FindHashEntry(&dictNames, key);
+    if (hPtr != NULL) {
+        dict = (DHCPDict*)Tcl_GetHashValue(hPtr);
+    }
+    Ns_RWLockUnlock(&dictLock);
+    return dict;
+}
 
-    for (i = 0; i < 255; i++) {
-        if (!strncasecmp(dict[i].name, part1, len)) {
-            if (part2 != NULL && dict[i].next != NULL) {
-                dict = dict[i].next;
-                len = strlen(name);
-                part1 = name;
-                part2 = NULL;
-                i = -1;
-                continue;
+/* Index all names of the main dictionary and its sub-dictionaries */
+static void DHCPDictInit(void)
+{
+    int i, j;
+
+    Tcl_InitHashTable(&dictNames, TCL_STRING_KEYS);
+    for (i = 0; i < 256; i++) {
+        if (main_dict[i].name != NULL) {
+            DHCPDictSet(&main_dict[i]);
+        }
+        if (main_dict[i].next != NULL) {
+            for (j = 0; j < 256; j++) {
+                if (main_dict[i].next[j].name != NULL) {
+                    DHCPDictSet(&main_dict[i].next[j]);
+                }
             }
-            return &dict[i];
         }
     }
-    return NULL;
+}
+
+/* Placeholder names like option-200 of slots without well known option */
+static int isGenericName(const char *name)
+{
+    const char *p;
+
+    if (strncmp(name, "option-", 7) || name[7] == 0) {
+        return 0;
+    }
+    for (p = name + 7; *p; p++) {
+        if (!isdigit((unsigned char)*p)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Add dictionary entry name to the index, the first entry of a name wins */
+static void DHCPDictSet(DHCPDict *dict)
+{
+    int isNew;
+    Ns_DString ds;
+    Tcl_HashEntry *hPtr;
+
+    Ns_DStringInit(&ds);
+    Ns_DStringAppend(&ds, dict->name);
+    Ns_StrToLower(ds.string);
+    hPtr = Tcl_CreateHashEntry(&dictNames, ds.string, &isNew);
+    if (isNew) {
+        Tcl_SetHashValue(hPtr, dict);
+    }
+    Ns_DStringFree(&ds);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DHCPDictAdd --
+ *
+ *	Define custom option in a dictionary slot which does not have a
+ *      well known option yet, sub-options are placed into the dictionary
+ *      of the parent code. Options should be defined before ranges use
+ *      them, existing option values are not converted.
+ *
+ * Results:
+ *	NS_OK or NS_ERROR with the interp result set
+ *
+ * Side effects:
+ *  	Name can be used in all commands which accept option names
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int DHCPDictAdd(Tcl_Interp *interp, char *name, int code, int subcode, char *type, int list)
+{
+    int found;
+    DHCPDict *dict;
+    Ns_DString ds, key;
+
+    if (code < 1 || code > 254 || subcode < 0 || subcode > 255) {
+        Tcl_AppendResult(interp, "invalid option code", NULL);
+        return NS_ERROR;
+    }
+    if (subcode > 0 && main_dict[code].next == NULL) {
+        Tcl_AppendResult(interp, "option ", main_dict[code].name, " does not have sub-options", NULL);
+        return NS_ERROR;
+    }
+    Ns_DStringInit(&ds);
+    if (subcode > 0 && strchr(name, '.') == NULL) {
+        Ns_DStringVarAppend(&ds, main_dict[code].name, ".", NULL);
+    }
+    Ns_DStringAppend(&ds, name);
+    dict = subcode > 0 ? &main_dict[code].next[subcode] : &main_dict[code];
+
+    /* Name check and slot claim under one lock, concurrent dictadd cannot both pass */
+    Ns_RWLockWrLock(&dictLock);
+    Ns_DStringInit(&key);
+    Ns_DStringAppend(&key, ds.string);
+    Ns_StrToLower(key.string);
+    found = Tcl_FindHashEntry(&dictNames, key.string) != NULL;
+    Ns_DStringFree(&key);
+    if (found) {
+        Ns_RWLockUnlock(&dictLock);
+        Tcl_AppendResult(interp, "option already defined: ", ds.string, NULL);
+        Ns_DStringFree(&ds);
+        return NS_ERROR;
+    }
+    if (dict->name != NULL && !isGenericName(dict->name)) {
+        Ns_RWLockUnlock(&dictLock);
+        Tcl_AppendResult(interp, "option code is already used by ", dict->name, NULL);
+        Ns_DStringFree(&ds);
+        return NS_ERROR;
+    }
+    dict->flags = getTypeID(type) | (list ? OPTION_LIST : 0);
+    dict->name = ns_strdup(ds.string);
+    DHCPDictSet(dict);
+    Ns_RWLockUnlock(&dictLock);
+    Ns_DStringFree(&ds);
+    return NS_OK;
 }
 
 static const char *getMessageName(u_int8_t type)
@@ -0,0 +1,102 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1(the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://www.mozilla.org/.
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis,WITHOUT WARRANTY OF ANY KIND,either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * Alternatively,the contents of this file may be used under the terms
+ * of the GNU General Public License(the "GPL"),in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License,indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above,a recipient may use your
+ * version of this file under either the License or the GPL.
+ *
+ * Author Vlad Seryakov vlad@crystalballinc.com
+ *
+ */
+
+/*
+ * nsdhcpd.h -- native policy plugins
+ *
+ *      Plugin is a shared library which exports Ns_DhcpPluginInit, it is
+ *      loaded for every library listed in the plugins parameter. The init
+ *      procedure fills hooks it implements, hooks are called in the thread
+ *      which processes the request, without Tcl interp, and must not block.
+ *      The request is accessed only through the api table, new members
+ *      are always added at the end of both structures.
+ */
+
+#ifndef NSDHCPD_H
+#define NSDHCPD_H
+
+#include <sys/types.h>
+
+#define NS_DHCP_PLUGIN_VERSION          1
+
+/* Results of classify and allocate hooks */
+#define NS_DHCP_CONTINUE                0   /* call next plugin */
+#define NS_DHCP_DONE                    1   /* skip remaining plugins */
+
+/* Fields for get and set, addresses are in network byte order */
+#define NS_DHCP_XID                     1
+#define NS_DHCP_CIADDR                  2
+#define NS_DHCP_YIADDR                  3
+#define NS_DHCP_SIADDR                  4
+#define NS_DHCP_GIADDR                  5
+#define NS_DHCP_REPLY_TYPE              10
+#define NS_DHCP_REPLY_YIADDR            11
+#define NS_DHCP_REPLY_SIADDR            12
+#define NS_DHCP_REPLY_NETMASK           13
+#define NS_DHCP_REPLY_GATEWAY           14
+#define NS_DHCP_REPLY_BROADCAST         15
+#define NS_DHCP_REPLY_NAMESERVER        16
+#define NS_DHCP_REPLY_LEASE_TIME        17  /* seconds */
+
+typedef struct _dhcpRequest Ns_DhcpRequest;
+
+typedef struct Ns_DhcpApi {
+    int version;
+    int (*msgtype)(Ns_DhcpRequest *req);
+    const char *(*macaddr)(Ns_DhcpRequest *req);
+    const char *(*clientid)(Ns_DhcpRequest *req);
+    u_int32_t (*get)(Ns_DhcpRequest *req, int field);
+    void (*set)(Ns_DhcpRequest *req, int field, u_int32_t value);
+    /* Raw option data of the received packet and its size as sent, subcode selects relay agent sub-option */
+    const u_int8_t *(*option)(Ns_DhcpRequest *req, int code, int subcode, int *size);
+    /* Adds reply option by dictionary name with value as ns_dhcpd reqset takes it */
+    int (*setOption)(Ns_DhcpRequest *req, const char *name, const char *value);
+    /* Selects the range which contains ipaddr, returns 0 if there is none */
+    int (*setRange)(Ns_DhcpRequest *req, u_int32_t ipaddr);
+    /* Start and end of the selected range, returns 0 if not selected yet */
+    int (*range)(Ns_DhcpRequest *req, u_int32_t *start, u_int32_t *end);
+} Ns_DhcpApi;
+
+typedef struct Ns_DhcpPlugin {
+    const char *name;
+    void *arg;
+    /* Before processing, may select the range with setRange */
+    int (*classify)(void *arg, Ns_DhcpRequest *req);
+    /* Before processing and run proc, setting reply type sends the reply as is */
+    int (*allocate)(void *arg, Ns_DhcpRequest *req);
+    /* After processing, whether reply was sent or not */
+    void (*reply)(void *arg, Ns_DhcpRequest *req);
+    /*
+     * Lease expired, called by the expire thread or by an allocation which
+     * reclaims expired leases, with the shard of the address locked.
+     * Leases removed by leasedel or rangedel are not reported. clientid
+     * may be NULL
+     */
+    void (*expire)(void *arg, u_int32_t ipaddr, const char *macaddr, const char *clientid);
+} Ns_DhcpPlugin;
+
+typedef int (Ns_DhcpPluginInitProc)(const char *server, const char *module, const Ns_DhcpApi *api, Ns_DhcpPlugin *plugin);
+
+#endif